@@ -0,0 +1,640 @@
+/* Light Gun XR - Light Gun Simulator for OpenXR and uinput
+ *
+ * Copyright (c) 2024 Ethan Lee
+ *
+ * This software is provided 'as-is', without any express or implied warranty.
+ * In no event will the authors be held liable for any damages arising from
+ * the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ * claim that you wrote the original software. If you use this software in a
+ * product, an acknowledgment in the product documentation would be
+ * appreciated but is not required.
+ *
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ * misrepresented as being the original software.
+ *
+ * 3. This notice may not be removed or altered from any source distribution.
+ *
+ * Ethan "flibitijibibo" Lee <flibitijibibo@flibitijibibo.com>
+ *
+ */
+
+/* Offline benchmark for the pointer mapping and uinput batching code.
+ *
+ * This pulls in lightgunxr.c directly (minus main) so that the static
+ * functions can be run without an OpenXR runtime or a headset. Poses are
+ * synthetic: a gun held in front of the screen sweeping a Lissajous pattern
+ * across it, with a bit of noise, partly going offscreen.
+ *
+ * Usage: make bench, or ./lightgunxr_bench [samples]
+ */
+
+#define LIGHTGUNXR_NO_MAIN
+#include "lightgunxr.c"
+
+#define DEFAULT_SAMPLES 1000000
+#define BENCH_RUNS 5
+
+/* Allocation counting. The hot paths shouldn't allocate at all! */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static size_t allocations = 0;
+
+void *malloc(size_t size)
+{
+	allocations += 1;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+	allocations += 1;
+	return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	allocations += 1;
+	return __libc_realloc(ptr, size);
+}
+
+/* Pose generation */
+
+static float frand(unsigned int *seed)
+{
+	*seed = (*seed * 1103515245u) + 12345u;
+	return ((*seed >> 8) & 0xFFFF) / 65535.0f;
+}
+
+/* Builds a pose at position, aiming its -Z axis at target. The gun is held
+ * upright like a real one: yaw around Y, then pitch around X, no roll. (The
+ * shortest rotation from -Z would do for the ray mapping, but turning all the
+ * way around to +Z that way leaves the gun upside down, and the Euler angles
+ * MAPPING_LEGACY reads come out flipped.)
+ */
+static void look_at(XrPosef *pose, const XrVector3f *position, const XrVector3f *target)
+{
+	XrVector3f dir = vec3_sub(target, position);
+	float yaw, pitch, sy, cy, sp, cp;
+
+	vec3_normalize(&dir);
+	yaw = atan2f(-dir.x, -dir.z);
+	pitch = asinf(dir.y);
+	sy = sinf(yaw * 0.5f);
+	cy = cosf(yaw * 0.5f);
+	sp = sinf(pitch * 0.5f);
+	cp = cosf(pitch * 0.5f);
+
+	pose->orientation.x = cy * sp;
+	pose->orientation.y = sy * cp;
+	pose->orientation.z = -sy * sp;
+	pose->orientation.w = cy * cp;
+	pose->position = *position;
+}
+
+/* Bilinear point on the calibrated quad, (u, v) in screen space */
+static XrVector3f quad_point(const ScreenRect *rect, float u, float v)
+{
+	const XrVector3f *c = rect->corners;
+	XrVector3f result;
+
+	#define LERP2(axis) \
+		result.axis = ( \
+			(c[CORNER_TOPLEFT].axis * (1 - u) * (1 - v)) + \
+			(c[CORNER_TOPRIGHT].axis * u * (1 - v)) + \
+			(c[CORNER_BOTTOMRIGHT].axis * u * v) + \
+			(c[CORNER_BOTTOMLEFT].axis * (1 - u) * v) \
+		);
+	LERP2(x)
+	LERP2(y)
+	LERP2(z)
+	#undef LERP2
+	return result;
+}
+
+static void generate_poses(XrPosef *poses, int count, const ScreenRect *rect)
+{
+	unsigned int seed = 0x4C475852;
+	XrVector3f position, target;
+	float u, v;
+	int i;
+
+	for (i = 0; i < count; i += 1)
+	{
+		/* The sweep overshoots the edges, so about a third of the
+		 * samples land offscreen
+		 */
+		u = 0.5f + (0.52f * sinf(i * 0.0013f));
+		v = 0.5f + (0.52f * sinf(i * 0.0021f + 1.0f));
+
+		position.x = ((frand(&seed) - 0.5f) * 0.002f) + (0.05f * sinf(i * 0.0001f));
+		position.y = 1.2f + ((frand(&seed) - 0.5f) * 0.002f);
+		position.z = -0.5f + ((frand(&seed) - 0.5f) * 0.002f);
+
+		target = quad_point(rect, u, v);
+		look_at(&poses[i], &position, &target);
+	}
+}
+
+/* A single rect that takes up the whole --screen, like the default setup */
+static void one_screen(Screens *screens, const ScreenRect *rect)
+{
+	memset(screens, '\0', sizeof(*screens));
+	screens->count = 1;
+	screens->rects[0] = *rect;
+	screens->targets[0][2] = 1.0f;
+	screens->targets[0][3] = 1.0f;
+	screens_prepare(screens);
+}
+
+/* Benchmarks */
+
+static double elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+	return (
+		((double) (end->tv_sec - start->tv_sec) * NS_PER_SEC) +
+		(double) (end->tv_nsec - start->tv_nsec)
+	);
+}
+
+static void bench_mapping(
+	const char *name,
+	const MappingMode mode,
+	const Screens *screens,
+	const XrPosef *poses,
+	int count
+) {
+	struct timespec start, end;
+	double best = 1e30, ns;
+	float mouseX, mouseY;
+	size_t allocs = 0;
+	int run, i, screen, hits = 0;
+
+	for (run = 0; run < BENCH_RUNS; run += 1)
+	{
+		mouseX = 0;
+		mouseY = 0;
+		screen = 0;
+		hits = 0;
+		allocations = 0;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < count; i += 1)
+		{
+			hits += (screens_to_pointer(screens, mode, &poses[i], &screen, &mouseX, &mouseY) == POINTER_MOVED);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		allocs += allocations;
+
+		ns = elapsed_ns(&start, &end);
+		best = (ns < best) ? ns : best;
+	}
+
+	printf(
+		"%-24s %8.2f ns/sample %6.1f%% hit %6zu allocs\n",
+		name,
+		best / count,
+		(100.0 * hits) / count,
+		allocs
+	);
+}
+
+/* Same as bench_mapping for MAPPING_RAY, but through pose_batch_to_pointer.
+ * The poses are put into batches ahead of time, the way they'd come out of
+ * sampler_map_batch, and then checked against the scalar path.
+ */
+static void bench_batch(const char *name, const ScreenRect *rect, const XrPosef *poses, int count)
+{
+	struct timespec start, end;
+	double best = 1e30, ns;
+	const int batchCount = (count + POSE_BATCH_SIZE - 1) / POSE_BATCH_SIZE;
+	PoseBatch *batches = (PoseBatch*) malloc(sizeof(PoseBatch) * batchCount);
+	float x[POSE_BATCH_SIZE], y[POSE_BATCH_SIZE];
+	uint8_t hits[POSE_BATCH_SIZE];
+	float mouseX, mouseY, scalarX, scalarY, dist, worst = 0;
+	Screens screens;
+	size_t allocs = 0;
+	int run, b, i, screen = 0, hitCount = 0, mismatches = 0;
+
+	one_screen(&screens, rect);
+
+	if (batches == NULL)
+	{
+		printf("Out of memory!\n");
+		return;
+	}
+	for (b = 0; b < batchCount; b += 1)
+	{
+		batches[b].count = 0;
+		for (i = 0; i < POSE_BATCH_SIZE; i += 1)
+		{
+			const int index = (b * POSE_BATCH_SIZE) + i;
+			pose_batch_set(&batches[b], i, &poses[(index < count) ? index : 0]);
+			batches[b].count += (index < count);
+		}
+	}
+
+	for (run = 0; run < BENCH_RUNS; run += 1)
+	{
+		mouseX = 0;
+		mouseY = 0;
+		hitCount = 0;
+		allocations = 0;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (b = 0; b < batchCount; b += 1)
+		{
+			pose_batch_to_pointer(&batches[b], rect, x, y, hits);
+			for (i = 0; i < batches[b].count; i += 1)
+			{
+				hitCount += (pointer_update(hits[i], x[i], y[i], &mouseX, &mouseY) == POINTER_MOVED);
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		allocs += allocations;
+
+		ns = elapsed_ns(&start, &end);
+		best = (ns < best) ? ns : best;
+	}
+
+	/* Any difference from the scalar path should just be rounding */
+	for (b = 0; b < batchCount; b += 1)
+	{
+		pose_batch_to_pointer(&batches[b], rect, x, y, hits);
+		for (i = 0; i < batches[b].count; i += 1)
+		{
+			const int index = (b * POSE_BATCH_SIZE) + i;
+			mouseX = -1;
+			mouseY = -1;
+			scalarX = -1;
+			scalarY = -1;
+			const int batchHit = pointer_update(hits[i], x[i], y[i], &mouseX, &mouseY) == POINTER_MOVED;
+			const int scalarHit = screens_to_pointer(
+				&screens,
+				MAPPING_RAY,
+				&poses[index],
+				&screen,
+				&scalarX,
+				&scalarY
+			) == POINTER_MOVED;
+			if (batchHit != scalarHit)
+			{
+				mismatches += 1;
+			}
+			else if (batchHit)
+			{
+				dist = fmaxf(
+					fabsf(mouseX - scalarX) * DEFAULT_SCREEN_WIDTH,
+					fabsf(mouseY - scalarY) * DEFAULT_SCREEN_HEIGHT
+				);
+				worst = (dist > worst) ? dist : worst;
+			}
+		}
+	}
+	free(batches);
+
+	printf(
+		"%-24s %8.2f ns/sample %6.1f%% hit %6zu allocs, %d mismatches, worst %.4f px off\n",
+		name,
+		best / count,
+		(100.0 * hitCount) / count,
+		allocs,
+		mismatches,
+		worst
+	);
+}
+
+/* How far apart the two mapping paths are, in pixels. MAPPING_LEGACY takes
+ * pitch and yaw separately, so it's exact along the axes through the center
+ * but pulls the corners in a little (about 28px at this fixture's corners,
+ * worse the wider the angles), and that's about all it should ever be off by.
+ * Any pose that either path puts on the rect is compared, unclipped, so a hit
+ * only one of them sees counts too.
+ *
+ * Returns 0 if they're further apart than LEGACY_TOLERANCE_PX anywhere.
+ */
+#define LEGACY_TOLERANCE_PX 40.0f
+
+static int compare_mapping(const ScreenRect *rect, const XrPosef *poses, int count)
+{
+	float legacyX, legacyY, rayX, rayY, dx, dy, dist;
+	double total = 0;
+	float worst = 0;
+	int i, compared = 0, onlyLegacy = 0, onlyRay = 0;
+
+	for (i = 0; i < count; i += 1)
+	{
+		const int legacyHit = (
+			intersect_legacy(&poses[i], rect, &legacyX, &legacyY) &&
+			pointer_on_rect(legacyX, legacyY)
+		);
+		const int rayHit = intersect_ray(&poses[i], rect, &rayX, &rayY);
+		const int rayOnRect = rayHit && pointer_on_rect(rayX, rayY);
+
+		if (!legacyHit && !rayOnRect)
+		{
+			continue;
+		}
+		if (!rayHit)
+		{
+			/* Legacy is on the rect with the ray pointing away, way off */
+			worst = INFINITY;
+			onlyLegacy += 1;
+			continue;
+		}
+		onlyLegacy += legacyHit && !rayOnRect;
+		onlyRay += rayOnRect && !legacyHit;
+
+		dx = (legacyX - rayX) * DEFAULT_SCREEN_WIDTH;
+		dy = (legacyY - rayY) * DEFAULT_SCREEN_HEIGHT;
+		dist = sqrtf((dx * dx) + (dy * dy));
+		total += dist;
+		worst = (dist > worst) ? dist : worst;
+		compared += 1;
+	}
+
+	printf(
+		"legacy vs. ray: %d compared (mean %.2f px, worst %.2f px, max %.0f px), %d legacy only, %d ray only\n",
+		compared,
+		(compared > 0) ? (total / compared) : 0.0,
+		worst,
+		LEGACY_TOLERANCE_PX,
+		onlyLegacy,
+		onlyRay
+	);
+	return worst <= LEGACY_TOLERANCE_PX;
+}
+
+/* Filter quality on a synthetic 1kHz pointer: the first half holds still at
+ * the center with tracker-like noise (jitter), the second half sweeps side to
+ * side at up to ~1 screen/second with the same noise (lag). Both are RMS error
+ * against the noiseless pointer, in pixels.
+ */
+static void bench_filter(const char *name, const FilterParams *params, int count)
+{
+	PointerFilter filter;
+	struct timespec start, end;
+	double stillError = 0, movingError = 0, ns;
+	unsigned int seed = 1234;
+	size_t allocs;
+	int i;
+
+	filter_reset(&filter);
+	allocations = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i += 1)
+	{
+		const uint64_t time = (uint64_t) i * (NS_PER_SEC / 1000);
+		const int moving = i >= (count / 2);
+		const float truthX = moving ?
+			(0.5f + (0.3f * sinf(2.0f * (float) M_PI * 0.5f * (time / (float) NS_PER_SEC)))) :
+			0.5f;
+		const float truthY = 0.5f;
+		float x = truthX + ((frand(&seed) - 0.5f) * 0.002f);
+		float y = truthY + ((frand(&seed) - 0.5f) * 0.002f);
+		float dx, dy;
+
+		if (params->mode != FILTER_NONE)
+		{
+			filter_apply(&filter, params, time, &x, &y);
+		}
+
+		dx = (x - truthX) * DEFAULT_SCREEN_WIDTH;
+		dy = (y - truthY) * DEFAULT_SCREEN_HEIGHT;
+		if (moving)
+		{
+			movingError += (dx * dx) + (dy * dy);
+		}
+		else
+		{
+			stillError += (dx * dx) + (dy * dy);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	allocs = allocations;
+	ns = elapsed_ns(&start, &end);
+
+	printf(
+		"%-24s %8.2f ns/sample %6.2f px jitter %6.2f px moving %6zu allocs\n",
+		name,
+		ns / count,
+		sqrt(stillError / (count / 2)),
+		sqrt(movingError / (count - (count / 2))),
+		allocs
+	);
+}
+
+/* A frame's worth of events: the pointer every frame, a button now and then */
+static void bench_events(const char *name, int batched, int fd, int frames)
+{
+	EventBatch batch;
+	struct input_event ie;
+	struct timespec start, end;
+	size_t allocs;
+	int i, buttons = 0;
+
+	batch.count = 0;
+	memset(&ie, '\0', sizeof(ie));
+
+	allocations = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < frames; i += 1)
+	{
+		const int button = (i % 64) == 0;
+		buttons += button;
+		if (batched)
+		{
+			if (button)
+			{
+				batch_push(&batch, EV_KEY, BTN_LEFT, (i / 64) & 1);
+			}
+			batch_push(&batch, EV_ABS, ABS_X, i % DEFAULT_SCREEN_WIDTH);
+			batch_push(&batch, EV_ABS, ABS_Y, i % DEFAULT_SCREEN_HEIGHT);
+			batch_flush(fd, &batch);
+		}
+		else
+		{
+			/* What the loop used to do, one write() per event */
+			#define WRITE_EVENT(t, c, v) \
+				ie.type = t; \
+				ie.code = c; \
+				ie.value = v; \
+				if (write(fd, &ie, sizeof(ie)) != sizeof(ie)) \
+				{ \
+					printf("write failed\n"); \
+					return; \
+				}
+			if (button)
+			{
+				WRITE_EVENT(EV_KEY, BTN_LEFT, (i / 64) & 1)
+			}
+			WRITE_EVENT(EV_ABS, ABS_X, i % DEFAULT_SCREEN_WIDTH)
+			WRITE_EVENT(EV_ABS, ABS_Y, i % DEFAULT_SCREEN_HEIGHT)
+			WRITE_EVENT(EV_SYN, SYN_REPORT, 0)
+			#undef WRITE_EVENT
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	allocs = allocations;
+
+	printf(
+		"%-24s %8.2f ns/frame  %6d buttons %6zu allocs\n",
+		name,
+		elapsed_ns(&start, &end) / frames,
+		buttons,
+		allocs
+	);
+}
+
+int main(int argc, char **argv)
+{
+	ScreenRect flat, tilted, wide;
+	Screens flatScreens, tiltedScreens, tripleScreens;
+	XrPosef *flatPoses, *tiltedPoses, *widePoses;
+	FilterParams filterParams;
+	int samples = DEFAULT_SAMPLES;
+	int fd, i;
+
+	if (argc > 1)
+	{
+		samples = atoi(argv[1]);
+		if (samples <= 0)
+		{
+			printf("Usage: %s [samples]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	/* Everything is laid out the way upstream's setup is, with the screens out
+	 * along +Z and the gun looking that way, since that's the only way around
+	 * MAPPING_LEGACY understands. Facing +Z, left is +X.
+	 *
+	 * A screen square on to the Z axis...
+	 */
+	memset(&flat, '\0', sizeof(flat));
+	flat.cornerCount = 2;
+	flat.corners[CORNER_TOPLEFT].x = 0.5f;
+	flat.corners[CORNER_TOPLEFT].y = 1.5f;
+	flat.corners[CORNER_TOPLEFT].z = 1.0f;
+	flat.corners[CORNER_BOTTOMRIGHT].x = -0.5f;
+	flat.corners[CORNER_BOTTOMRIGHT].y = 0.9f;
+	flat.corners[CORNER_BOTTOMRIGHT].z = 1.0f;
+	if (!screen_rect_calibrate(&flat))
+	{
+		printf("Flat calibration failed!\n");
+		return 1;
+	}
+
+	/* ... and a tilted CRT that isn't quite square */
+	memset(&tilted, '\0', sizeof(tilted));
+	tilted.cornerCount = 4;
+	tilted.corners[CORNER_TOPLEFT].x = 0.45f;
+	tilted.corners[CORNER_TOPLEFT].y = 1.45f;
+	tilted.corners[CORNER_TOPLEFT].z = 1.2f;
+	tilted.corners[CORNER_TOPRIGHT].x = -0.5f;
+	tilted.corners[CORNER_TOPRIGHT].y = 1.5f;
+	tilted.corners[CORNER_TOPRIGHT].z = 0.9f;
+	tilted.corners[CORNER_BOTTOMRIGHT].x = -0.5f;
+	tilted.corners[CORNER_BOTTOMRIGHT].y = 0.85f;
+	tilted.corners[CORNER_BOTTOMRIGHT].z = 0.85f;
+	tilted.corners[CORNER_BOTTOMLEFT].x = 0.5f;
+	tilted.corners[CORNER_BOTTOMLEFT].y = 0.9f;
+	tilted.corners[CORNER_BOTTOMLEFT].z = 1.25f;
+	if (!screen_rect_calibrate(&tilted))
+	{
+		printf("Tilted calibration failed!\n");
+		return 1;
+	}
+
+	/* Three of the flat screen side by side, with the poses sweeping all of
+	 * them. With one rect per screen, the mapping shouldn't get much slower.
+	 */
+	memset(&tripleScreens, '\0', sizeof(tripleScreens));
+	tripleScreens.count = 3;
+	for (i = 0; i < 3; i += 1)
+	{
+		ScreenRect *rect = &tripleScreens.rects[i];
+		*rect = flat;
+		rect->corners[CORNER_TOPLEFT].x = flat.corners[CORNER_TOPLEFT].x + (1 - i);
+		rect->corners[CORNER_BOTTOMRIGHT].x = flat.corners[CORNER_BOTTOMRIGHT].x + (1 - i);
+		screen_rect_calibrate(rect);
+		tripleScreens.targets[i][0] = i / 3.0f;
+		tripleScreens.targets[i][2] = 1.0f / 3.0f;
+		tripleScreens.targets[i][3] = 1.0f;
+	}
+	screens_prepare(&tripleScreens);
+	wide = flat;
+	wide.corners[CORNER_TOPLEFT] = tripleScreens.rects[0].corners[CORNER_TOPLEFT];
+	wide.corners[CORNER_BOTTOMRIGHT] = tripleScreens.rects[2].corners[CORNER_BOTTOMRIGHT];
+	screen_rect_calibrate(&wide);
+
+	one_screen(&flatScreens, &flat);
+	one_screen(&tiltedScreens, &tilted);
+
+	flatPoses = (XrPosef*) malloc(sizeof(XrPosef) * samples);
+	tiltedPoses = (XrPosef*) malloc(sizeof(XrPosef) * samples);
+	widePoses = (XrPosef*) malloc(sizeof(XrPosef) * samples);
+	if (flatPoses == NULL || tiltedPoses == NULL || widePoses == NULL)
+	{
+		printf("Out of memory!\n");
+		return 1;
+	}
+	generate_poses(flatPoses, samples, &flat);
+	generate_poses(tiltedPoses, samples, &tilted);
+	generate_poses(widePoses, samples, &wide);
+
+#if defined(__SSE__)
+	const char *batchPath = "SSE";
+#elif defined(HAVE_VEC4)
+	const char *batchPath = "NEON";
+#else
+	const char *batchPath = "scalar";
+#endif
+	printf("%d samples, best of %d runs, %s batches\n\n", samples, BENCH_RUNS, batchPath);
+
+	bench_mapping("legacy, 2 corners", MAPPING_LEGACY, &flatScreens, flatPoses, samples);
+	bench_mapping("ray, 2 corners", MAPPING_RAY, &flatScreens, flatPoses, samples);
+	bench_mapping("ray, 4 corners (tilted)", MAPPING_RAY, &tiltedScreens, tiltedPoses, samples);
+	bench_mapping("ray, 3 screens", MAPPING_RAY, &tripleScreens, widePoses, samples);
+	bench_mapping("legacy, 3 screens", MAPPING_LEGACY, &tripleScreens, widePoses, samples);
+	bench_batch("ray, batched", &flat, flatPoses, samples);
+	bench_batch("ray, batched, tilted", &tilted, tiltedPoses, samples);
+	if (!compare_mapping(&flat, flatPoses, samples))
+	{
+		printf("Legacy and ray mappings disagree!\n");
+		return 1;
+	}
+	printf("\n");
+
+	/* Note that the timing includes generating the input */
+	filterParams.minCutoff = DEFAULT_FILTER_MIN_CUTOFF;
+	filterParams.beta = DEFAULT_FILTER_BETA;
+	filterParams.mode = FILTER_NONE;
+	bench_filter("filter, none", &filterParams, samples);
+	filterParams.mode = FILTER_ONE_EURO;
+	bench_filter("filter, one euro", &filterParams, samples);
+	filterParams.beta = 0.0f;
+	bench_filter("filter, one euro, beta 0", &filterParams, samples);
+	printf("\n");
+
+	fd = open("/dev/null", O_WRONLY);
+	if (fd == -1)
+	{
+		printf("/dev/null could not be opened\n");
+		return 1;
+	}
+	bench_events("events, one write each", 0, fd, samples / 10);
+	bench_events("events, batched", 1, fd, samples / 10);
+	close(fd);
+
+	free(flatPoses);
+	free(tiltedPoses);
+	free(widePoses);
+	return 0;
+}
@@ -25,18 +25,44 @@
  */
 
 /* Instructions:
- * TODO: Setup process for screen rectangle calibration
+ * On startup, hold the gun against each corner of the screen as prompted and
+ * pull the trigger. By default this is the top left and bottom right corners;
+ * for screens that don't face straight down the stage Z axis, use --corners 3
+ * (adds top right/bottom left) or --corners 4 (any convex quad).
+ *
+ * For more than one screen (or separate hit regions, like a marquee), use
+ * --screens <n>: each one is calibrated in turn, and --target says where each
+ * one is on the --screen. By default they're side by side.
+ *
+ * For two players, use --guns 2. Player 1 is the right hand and player 2 is the
+ * left, each gets its own uinput device and either one can calibrate.
  *
  * Don't forget to link SteamVR as the active OpenXR runtime!
  * ln -sf ~/.steam/steam/steamapps/common/SteamVR/steamxr_linux64.json ~/.config/openxr/1/active_runtime.json
  */
 
+#define _GNU_SOURCE /* pthread_setaffinity_np, CPU_SET */
 #include <openxr/openxr.h>
-#include <stdio.h> /* printf */
-#include <string.h> /* strncpy, memset */
-#include <unistd.h> /* usleep */
-#include <time.h> /* clock_gettime */
-#include <math.h> /* fabsf, fmodf, sqrtf, powf, cosf, asinf, M_PI */
+#include <stdio.h> /* printf, snprintf, rename, fseek */
+#include <stdlib.h> /* atoi, atof, getenv */
+#include <stddef.h> /* offsetof */
+#include <stdint.h> /* uint32_t */
+#include <string.h> /* strncpy, memset, memcmp, strerror, strcmp, strtok_r */
+#include <ctype.h> /* toupper, islower, isdigit */
+#include <unistd.h> /* write, close, unlink */
+#include <time.h> /* clock_gettime, clock_nanosleep */
+#include <math.h> /* fabsf, fmodf, sqrtf, powf, cosf, asinf, lrintf, M_PI */
+#include <stdatomic.h> /* atomic_int, atomic_uint */
+#include <pthread.h> /* pthread_create, pthread_setschedparam */
+#include <sched.h> /* SCHED_FIFO, cpu_set_t */
+#include <signal.h> /* signal, pthread_sigmask, SIGUSR1 */
+#include <semaphore.h> /* sem_post, sem_timedwait */
+
+#if defined(__SSE__)
+#include <xmmintrin.h> /* _mm_add_ps, _mm_div_ps, ... */
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h> /* vaddq_f32, vdivq_f32, ... */
+#endif
 
 #define XR_USE_TIMESPEC
 #include <openxr/openxr_platform.h> /* xrConvertTimespecTimeToTimeKHR */
@@ -44,39 +70,560 @@
 #ifdef __linux__
 #include <linux/uinput.h>
 #include <errno.h>
-#include <fcntl.h> /* open, write */
+#include <fcntl.h> /* open */
+#include <sys/mman.h> /* mmap */
+#include <sys/stat.h> /* fstat */
+#include <sys/resource.h> /* setpriority */
+#include <sys/syscall.h> /* SYS_gettid */
+#include <sys/socket.h> /* socket, accept4, recv, send */
+#include <sys/un.h> /* sockaddr_un */
+#include <dirent.h> /* opendir, readdir */
 #else
 #error Only Linux is supported!
 #endif
 
-#define SCREEN_WIDTH 1920
-#define SCREEN_HEIGHT 1080
+/* The display mode, override with --screen */
+#define DEFAULT_SCREEN_WIDTH 1920
+#define DEFAULT_SCREEN_HEIGHT 1080
 
-/* Given a pose with position/orientation and a rect defined by four 3D points,
- * attempts to find where a ray casted by the pose intersects with the rect,
- * then normalizes the result.
+#ifdef __linux__
+
+/* Every event generated in a single loop iteration is accumulated here and
+ * then submitted with one write() along with the SYN_REPORT. This keeps the
+ * syscall count down and guarantees that a reader never sees half a report
+ * (for example, a new ABS_X without its matching ABS_Y).
  *
- * For example, a pose pointing directly at the center of the rectangle will
- * evaluate to [0.5, 0.5].
+ * Every button + the reload key + two axes + MSC_TIMESTAMP + SYN_REPORT is
+ * the worst case today, the extra room is just so nobody has to think about it
+ * when adding more.
+ */
+#define MAX_BATCH_EVENTS 16
+
+typedef struct EventBatch
+{
+	struct input_event events[MAX_BATCH_EVENTS];
+	int count;
+} EventBatch;
+
+/* ie->time is left at 0: uinput throws away whatever userspace puts there and
+ * evdev stamps every event itself as it hands it on. When a report has a
+ * better time than that, it goes out as MSC_TIMESTAMP instead.
+ */
+static void batch_append(EventBatch *batch, int type, int code, int value)
+{
+	struct input_event *ie = &batch->events[batch->count++];
+
+	ie->time.tv_sec = 0;
+	ie->time.tv_usec = 0;
+	ie->type = type;
+	ie->code = code;
+	ie->value = value;
+}
+
+static void batch_push(EventBatch *batch, int type, int code, int value)
+{
+	/* Leave room for the SYN_REPORT */
+	if (batch->count >= (MAX_BATCH_EVENTS - 1))
+	{
+		return;
+	}
+	batch_append(batch, type, code, value);
+}
+
+/* Terminates the batch with SYN_REPORT and writes it out in one go. If the
+ * batch is empty, nothing is written at all.
  *
- * When the ray does NOT point at the rectangle (i.e. it's parallel to or facing
- * away from it) the result is discarded entirely.
+ * Returns 0 on success, otherwise the errno of the failed write (EIO for a
+ * short write).
+ */
+static int batch_flush(int fd, EventBatch *batch)
+{
+	ssize_t len, written;
+
+	if (batch->count == 0)
+	{
+		return 0;
+	}
+	/* Always fits, batch_push keeps the last slot free for it */
+	batch_append(batch, EV_SYN, SYN_REPORT, 0);
+
+	len = batch->count * sizeof(struct input_event);
+	written = write(fd, batch->events, len);
+	batch->count = 0;
+	if (written != len)
+	{
+		return (written < 0) ? errno : EIO;
+	}
+	return 0;
+}
+
+/* Creates the uinput device for one gun, returns the fd or -1 with errno set.
+ * The first gun keeps the original name/product so existing game configs
+ * still find it.
+ */
+#define UINPUT_VENDOR 0x0420
+
+static int uinput_create(
+	int gun,
+	const int *keys,
+	int keyCount,
+	int axisMaxX,
+	int axisMaxY
+) {
+	struct uinput_setup usetup;
+	struct uinput_abs_setup abssetup;
+	int i;
+
+	const int fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+	if (fd == -1)
+	{
+		return -1;
+	}
+
+	ioctl(fd, UI_SET_EVBIT, EV_KEY);
+	for (i = 0; i < keyCount; i += 1)
+	{
+		ioctl(fd, UI_SET_KEYBIT, keys[i]);
+	}
+
+	ioctl(fd, UI_SET_EVBIT, EV_ABS);
+	ioctl(fd, UI_SET_ABSBIT, ABS_X);
+	ioctl(fd, UI_SET_ABSBIT, ABS_Y);
+
+	/* When the buttons really changed, see sampler_process */
+	ioctl(fd, UI_SET_EVBIT, EV_MSC);
+	ioctl(fd, UI_SET_MSCBIT, MSC_TIMESTAMP);
+
+	ioctl(fd, UI_SET_EVBIT, EV_SYN);
+
+	memset(&usetup, '\0', sizeof(usetup));
+	usetup.id.bustype = BUS_USB;
+	usetup.id.vendor = UINPUT_VENDOR;
+	usetup.id.product = 0x6969 + gun;
+	if (gun == 0)
+	{
+		strncpy(usetup.name, "Light Gun XR", sizeof(usetup.name));
+	}
+	else
+	{
+		snprintf(usetup.name, sizeof(usetup.name), "Light Gun XR %d", gun + 1);
+	}
+	ioctl(fd, UI_DEV_SETUP, &usetup);
+
+	abssetup.absinfo.value = 0;
+	abssetup.absinfo.minimum = 0;
+	abssetup.absinfo.fuzz = 0;
+	abssetup.absinfo.flat = 0;
+	abssetup.absinfo.resolution = 0;
+
+	abssetup.code = ABS_X;
+	abssetup.absinfo.maximum = axisMaxX;
+	ioctl(fd, UI_ABS_SETUP, &abssetup);
+	abssetup.code = ABS_Y;
+	abssetup.absinfo.maximum = axisMaxY;
+	ioctl(fd, UI_ABS_SETUP, &abssetup);
+
+	ioctl(fd, UI_DEV_CREATE);
+	return fd;
+}
+
+static void uinput_destroy(int fd)
+{
+	ioctl(fd, UI_DEV_DESTROY);
+	close(fd);
+}
+
+/* Latency self-test, see --latency-test. Every report carries the pose's
+ * sample time in microseconds as MSC_TIMESTAMP (instead of the button times),
+ * and the service thread reads the reports back from the guns' own evdev
+ * nodes. evdev stamps each event as it hands it to readers, so the difference
+ * is the whole pipeline from sampling the pose to a game being able to read
+ * it. Both ends are CLOCK_MONOTONIC and wrap at 32 bits, like hardware
+ * MSC_TIMESTAMPs do.
+ */
+#define EVDEV_WAIT_NS 2000000000ULL /* How long udev gets to make the node */
+
+typedef struct EvdevReader
+{
+	int fd; /* -1 until the node is open */
+	int failed; /* Don't bother trying again */
+	uint32_t stamp; /* MSC_TIMESTAMP of the report being read */
+	int stamped;
+	int dropped; /* SYN_DROPPED, skip to the next SYN_REPORT */
+} EvdevReader;
+
+/* Finds the evdev node for a uinput device. Returns the fd or -1 with errno
+ * set, ENOENT meaning it's not there yet.
+ */
+static int evdev_open(int uinputFd)
+{
+	char sysname[64];
+	char path[512];
+	DIR *dir;
+	struct dirent *entry;
+	struct input_id id;
+	int clock = CLOCK_MONOTONIC;
+	int fd = -1;
+
+	if (ioctl(uinputFd, UI_GET_SYSNAME(sizeof(sysname)), sysname) == -1)
+	{
+		return -1;
+	}
+	snprintf(path, sizeof(path), "/sys/devices/virtual/input/%s", sysname);
+	dir = opendir(path);
+	if (dir == NULL)
+	{
+		return -1;
+	}
+	errno = ENOENT;
+	while ((entry = readdir(dir)) != NULL)
+	{
+		if (strncmp(entry->d_name, "event", 5) == 0)
+		{
+			snprintf(path, sizeof(path), "/dev/input/%s", entry->d_name);
+			fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+			break;
+		}
+	}
+	closedir(dir);
+	if (fd == -1)
+	{
+		return -1;
+	}
+
+	/* Make sure it's really ours before trusting its timestamps */
+	if (	ioctl(fd, EVIOCGID, &id) == -1 ||
+		id.vendor != UINPUT_VENDOR ||
+		ioctl(fd, EVIOCSCLOCKID, &clock) == -1	)
+	{
+		close(fd);
+		errno = ENODEV;
+		return -1;
+	}
+	return fd;
+}
+
+#endif /* __linux__ */
+
+/* The screen rect is calibrated by holding the gun up to its corners and
+ * pulling the trigger, so each corner is a position in stage space.
  *
- * When the result is valid AND newer than the current values of mouseX/mouseY,
- * the result is written to mouseX/mouseY and the function returns 1. Otherwise,
- * the function returns 0 and it can be assumed that mouseX/mouseY are still
- * valid.
+ * With 2 corners (top left, bottom right) the rect is assumed to face straight
+ * down the stage Z axis, which is what the original calibration did.
+ *
+ * With 3 corners (top left, top right, bottom left) the rect can be at any
+ * orientation, but is assumed to be a parallelogram.
+ *
+ * With all 4 corners the rect can be any convex quad on a plane, which soaks up
+ * both tilted screens and some measurement error from the calibration shots.
+ *
+ * In all cases we end up with a plane and a 3x4 matrix that takes a point on
+ * that plane straight to homogeneous [0, 1] screen coordinates. The matrix is
+ * the plane's 2D basis followed by a homography, so after calibration the
+ * hot path is just a ray/plane intersection plus the one matrix multiply.
+ */
+typedef enum Corner
+{
+	CORNER_TOPLEFT,
+	CORNER_TOPRIGHT,
+	CORNER_BOTTOMRIGHT,
+	CORNER_BOTTOMLEFT
+} Corner;
+
+static const char *cornerNames[4] =
+{
+	"Top left",
+	"Top right",
+	"Bottom right",
+	"Bottom left"
+};
+
+/* The order that corners are recorded in, by corner count */
+static const Corner calibrationOrder[3][4] =
+{
+	{ CORNER_TOPLEFT, CORNER_BOTTOMRIGHT },
+	{ CORNER_TOPLEFT, CORNER_TOPRIGHT, CORNER_BOTTOMLEFT },
+	{ CORNER_TOPLEFT, CORNER_TOPRIGHT, CORNER_BOTTOMRIGHT, CORNER_BOTTOMLEFT }
+};
+
+typedef struct ScreenRect
+{
+	/* Calibration input */
+	XrVector3f corners[4];
+	int cornerCount;
+
+	/* Plane basis */
+	XrVector3f origin;
+	XrVector3f axisX;
+	XrVector3f axisY;
+	XrVector3f normal;
+	float planeDist; /* dot(normal, origin) */
+
+	/* Stage space -> homogeneous screen space */
+	float mapping[3][4];
+
+	/* Axis-aligned version of the rect, for MAPPING_LEGACY */
+	float x0, x1, y0, y1, depth;
+} ScreenRect;
+
+static float vec3_dot(const XrVector3f *a, const XrVector3f *b)
+{
+	return (a->x * b->x) + (a->y * b->y) + (a->z * b->z);
+}
+
+static XrVector3f vec3_sub(const XrVector3f *a, const XrVector3f *b)
+{
+	XrVector3f result;
+	result.x = a->x - b->x;
+	result.y = a->y - b->y;
+	result.z = a->z - b->z;
+	return result;
+}
+
+static XrVector3f vec3_cross(const XrVector3f *a, const XrVector3f *b)
+{
+	XrVector3f result;
+	result.x = (a->y * b->z) - (a->z * b->y);
+	result.y = (a->z * b->x) - (a->x * b->z);
+	result.z = (a->x * b->y) - (a->y * b->x);
+	return result;
+}
+
+static int vec3_normalize(XrVector3f *v)
+{
+	float len = sqrtf(vec3_dot(v, v));
+	if (len < 1e-6f)
+	{
+		return 0;
+	}
+	v->x /= len;
+	v->y /= len;
+	v->z /= len;
+	return 1;
+}
+
+/* Builds the homography that takes the unit square to the quad q, where
+ * q[0..3] are (0, 0), (1, 0), (1, 1), (0, 1) in that order.
+ *
+ * This is the closed-form version from Heckbert's "Fundamentals of Texture
+ * Mapping and Image Warping", which avoids a general 8x8 solve.
+ */
+static int square_to_quad(double q[4][2], double m[3][3])
+{
+	double sx = q[0][0] - q[1][0] + q[2][0] - q[3][0];
+	double sy = q[0][1] - q[1][1] + q[2][1] - q[3][1];
+	double g, h;
+
+	if (fabs(sx) < 1e-9 && fabs(sy) < 1e-9)
+	{
+		/* Parallelogram, the mapping is affine */
+		g = 0;
+		h = 0;
+	}
+	else
+	{
+		double dx1 = q[1][0] - q[2][0];
+		double dx2 = q[3][0] - q[2][0];
+		double dy1 = q[1][1] - q[2][1];
+		double dy2 = q[3][1] - q[2][1];
+		double den = (dx1 * dy2) - (dx2 * dy1);
+		if (fabs(den) < 1e-12)
+		{
+			return 0;
+		}
+		g = ((sx * dy2) - (dx2 * sy)) / den;
+		h = ((dx1 * sy) - (sx * dy1)) / den;
+	}
+
+	m[0][0] = q[1][0] - q[0][0] + (g * q[1][0]);
+	m[0][1] = q[3][0] - q[0][0] + (h * q[3][0]);
+	m[0][2] = q[0][0];
+	m[1][0] = q[1][1] - q[0][1] + (g * q[1][1]);
+	m[1][1] = q[3][1] - q[0][1] + (h * q[3][1]);
+	m[1][2] = q[0][1];
+	m[2][0] = g;
+	m[2][1] = h;
+	m[2][2] = 1;
+	return 1;
+}
+
+static int mat3_invert(double m[3][3], double out[3][3])
+{
+	double det = (
+		(m[0][0] * ((m[1][1] * m[2][2]) - (m[1][2] * m[2][1]))) -
+		(m[0][1] * ((m[1][0] * m[2][2]) - (m[1][2] * m[2][0]))) +
+		(m[0][2] * ((m[1][0] * m[2][1]) - (m[1][1] * m[2][0])))
+	);
+	int row, col;
+
+	if (fabs(det) < 1e-12)
+	{
+		return 0;
+	}
+
+	out[0][0] = (m[1][1] * m[2][2]) - (m[1][2] * m[2][1]);
+	out[0][1] = (m[0][2] * m[2][1]) - (m[0][1] * m[2][2]);
+	out[0][2] = (m[0][1] * m[1][2]) - (m[0][2] * m[1][1]);
+	out[1][0] = (m[1][2] * m[2][0]) - (m[1][0] * m[2][2]);
+	out[1][1] = (m[0][0] * m[2][2]) - (m[0][2] * m[2][0]);
+	out[1][2] = (m[0][2] * m[1][0]) - (m[0][0] * m[1][2]);
+	out[2][0] = (m[1][0] * m[2][1]) - (m[1][1] * m[2][0]);
+	out[2][1] = (m[0][1] * m[2][0]) - (m[0][0] * m[2][1]);
+	out[2][2] = (m[0][0] * m[1][1]) - (m[0][1] * m[1][0]);
+	for (row = 0; row < 3; row += 1)
+	for (col = 0; col < 3; col += 1)
+	{
+		out[row][col] /= det;
+	}
+	return 1;
+}
+
+/* Turns the recorded corners into the plane basis and mapping. Only the corners
+ * listed in calibrationOrder for rect->cornerCount need to be filled in.
+ *
+ * Returns 0 if the corners are degenerate (i.e. they don't form a rect), in
+ * which case calibration should be redone.
+ */
+static int screen_rect_calibrate(ScreenRect *rect)
+{
+	XrVector3f *c = rect->corners;
+	XrVector3f edgeX, edgeY, offset;
+	double quad[4][2], squareToQuad[3][3], quadToSquare[3][3];
+	int i, row;
+
+	if (rect->cornerCount == 2)
+	{
+		/* Screen faces down the Z axis, closest corner wins */
+		rect->depth = (c[CORNER_TOPLEFT].z < c[CORNER_BOTTOMRIGHT].z) ?
+			c[CORNER_TOPLEFT].z :
+			c[CORNER_BOTTOMRIGHT].z;
+		c[CORNER_TOPLEFT].z = rect->depth;
+		c[CORNER_BOTTOMRIGHT].z = rect->depth;
+
+		c[CORNER_TOPRIGHT] = c[CORNER_TOPLEFT];
+		c[CORNER_TOPRIGHT].x = c[CORNER_BOTTOMRIGHT].x;
+		c[CORNER_BOTTOMLEFT] = c[CORNER_TOPLEFT];
+		c[CORNER_BOTTOMLEFT].y = c[CORNER_BOTTOMRIGHT].y;
+
+		rect->origin = c[CORNER_TOPLEFT];
+		rect->axisX.x = 1;
+		rect->axisX.y = 0;
+		rect->axisX.z = 0;
+		rect->axisY.x = 0;
+		rect->axisY.y = 1;
+		rect->axisY.z = 0;
+		rect->normal.x = 0;
+		rect->normal.y = 0;
+		rect->normal.z = 1;
+	}
+	else
+	{
+		if (rect->cornerCount == 3)
+		{
+			/* Parallelogram, fill in the missing corner */
+			c[CORNER_BOTTOMRIGHT].x = c[CORNER_TOPRIGHT].x + c[CORNER_BOTTOMLEFT].x - c[CORNER_TOPLEFT].x;
+			c[CORNER_BOTTOMRIGHT].y = c[CORNER_TOPRIGHT].y + c[CORNER_BOTTOMLEFT].y - c[CORNER_TOPLEFT].y;
+			c[CORNER_BOTTOMRIGHT].z = c[CORNER_TOPRIGHT].z + c[CORNER_BOTTOMLEFT].z - c[CORNER_TOPLEFT].z;
+		}
+
+		/* Use the averaged edges of the quad so that no single corner
+		 * decides the orientation of the plane
+		 */
+		edgeX.x = (c[CORNER_TOPRIGHT].x - c[CORNER_TOPLEFT].x) + (c[CORNER_BOTTOMRIGHT].x - c[CORNER_BOTTOMLEFT].x);
+		edgeX.y = (c[CORNER_TOPRIGHT].y - c[CORNER_TOPLEFT].y) + (c[CORNER_BOTTOMRIGHT].y - c[CORNER_BOTTOMLEFT].y);
+		edgeX.z = (c[CORNER_TOPRIGHT].z - c[CORNER_TOPLEFT].z) + (c[CORNER_BOTTOMRIGHT].z - c[CORNER_BOTTOMLEFT].z);
+		edgeY.x = (c[CORNER_BOTTOMLEFT].x - c[CORNER_TOPLEFT].x) + (c[CORNER_BOTTOMRIGHT].x - c[CORNER_TOPRIGHT].x);
+		edgeY.y = (c[CORNER_BOTTOMLEFT].y - c[CORNER_TOPLEFT].y) + (c[CORNER_BOTTOMRIGHT].y - c[CORNER_TOPRIGHT].y);
+		edgeY.z = (c[CORNER_BOTTOMLEFT].z - c[CORNER_TOPLEFT].z) + (c[CORNER_BOTTOMRIGHT].z - c[CORNER_TOPRIGHT].z);
+
+		rect->normal = vec3_cross(&edgeX, &edgeY);
+		rect->axisX = edgeX;
+		if (!vec3_normalize(&rect->normal) || !vec3_normalize(&rect->axisX))
+		{
+			return 0;
+		}
+		rect->axisY = vec3_cross(&rect->normal, &rect->axisX);
+
+		/* The plane goes through the middle of the corners */
+		rect->origin.x = (c[0].x + c[1].x + c[2].x + c[3].x) * 0.25f;
+		rect->origin.y = (c[0].y + c[1].y + c[2].y + c[3].y) * 0.25f;
+		rect->origin.z = (c[0].z + c[1].z + c[2].z + c[3].z) * 0.25f;
+
+		rect->depth = c[0].z;
+		for (i = 1; i < 4; i += 1)
+		{
+			rect->depth = (rect->depth < c[i].z) ? rect->depth : c[i].z;
+		}
+	}
+	rect->planeDist = vec3_dot(&rect->normal, &rect->origin);
+
+	rect->x0 = c[CORNER_TOPLEFT].x;
+	rect->y0 = c[CORNER_TOPLEFT].y;
+	rect->x1 = c[CORNER_BOTTOMRIGHT].x;
+	rect->y1 = c[CORNER_BOTTOMRIGHT].y;
+
+	/* Project the corners onto the plane... */
+	for (i = 0; i < 4; i += 1)
+	{
+		offset = vec3_sub(&c[i], &rect->origin);
+		quad[i][0] = vec3_dot(&offset, &rect->axisX);
+		quad[i][1] = vec3_dot(&offset, &rect->axisY);
+	}
+
+	/* ... then map the quad on the plane to the unit square */
+	if (	!square_to_quad(quad, squareToQuad) ||
+		!mat3_invert(squareToQuad, quadToSquare)	)
+	{
+		return 0;
+	}
+
+	/* Fold the plane basis into the homography:
+	 * [u v w] = H * [dot(p - origin, axisX), dot(p - origin, axisY), 1]
+	 */
+	for (row = 0; row < 3; row += 1)
+	{
+		const double hx = quadToSquare[row][0];
+		const double hy = quadToSquare[row][1];
+		rect->mapping[row][0] = (hx * rect->axisX.x) + (hy * rect->axisY.x);
+		rect->mapping[row][1] = (hx * rect->axisX.y) + (hy * rect->axisY.y);
+		rect->mapping[row][2] = (hx * rect->axisX.z) + (hy * rect->axisY.z);
+		rect->mapping[row][3] = quadToSquare[row][2] - (
+			(hx * vec3_dot(&rect->origin, &rect->axisX)) +
+			(hy * vec3_dot(&rect->origin, &rect->axisY))
+		);
+	}
+	return 1;
+}
+
+/* There are two ways to get from a pose to a point on the screen rect:
+ *
+ * MAPPING_RAY rotates the pose's forward vector (-Z, per the OpenXR spec for
+ * aim poses) by the orientation quaternion, intersects it with the plane of
+ * the rect, then runs the hit point through the calibrated mapping. That's a
+ * few dozen multiply/adds and two divides (one for the ray, one for the
+ * homography), with no special cases at any angle.
+ *
+ * MAPPING_LEGACY is the original Euler angle version, built around flibit's
+ * setup. It's kept around so the two can be compared against each other. It
+ * only understands the axis-aligned version of the rect.
  */
-static int pose_to_pointer(
+typedef enum MappingMode
+{
+	MAPPING_RAY,
+	MAPPING_LEGACY
+} MappingMode;
+
+static int intersect_legacy(
 	const XrPosef *pose,
-	const float x0,
-	const float x1,
-	const float y0,
-	const float y1,
-	const float depth,
-	float *mouseX,
-	float *mouseY
+	const ScreenRect *rect,
+	float *resultX,
+	float *resultY
 ) {
+	const float x0 = rect->x0;
+	const float x1 = rect->x1;
+	const float y0 = rect->y0;
+	const float y1 = rect->y1;
+	const float depth = rect->depth;
 	float normalDistance = fabsf(pose->position.z - depth);
 
 	/* Convert quaternion to pitch/yaw, we don't care about roll */
@@ -113,27 +660,4940 @@ static int pose_to_pointer(
 	float offX = sqrtf(powf(normalDistance / cosf(poseAngleX), 2) - (normalDistance * normalDistance));
 	float offY = sqrtf(powf(normalDistance / cosf(poseAngleY), 2) - (normalDistance * normalDistance));
 
-	/* Reintroduce the +/- attrib, the above values are always positive */
-	offX *= (poseAngleX > 0) - (poseAngleX < 0);
-	offY *= (poseAngleY > 0) - (poseAngleY < 0);
+	/* Reintroduce the +/- attrib, the above values are always positive */
+	offX *= (poseAngleX > 0) - (poseAngleX < 0);
+	offY *= (poseAngleY > 0) - (poseAngleY < 0);
+
+	/* Add length of side B to pose->position, normalize result */
+	*resultX = ((pose->position.x - offX) - x0) / (x1 - x0);
+	*resultY = ((pose->position.y + offY) - y0) / (y1 - y0);
+	return 1;
+}
+
+/* Rotate (0, 0, -1) by the quaternion. This is just the negated third column
+ * of the quaternion's rotation matrix.
+ */
+static void pose_direction(const XrPosef *pose, XrVector3f *dir)
+{
+	const float qx = pose->orientation.x;
+	const float qy = pose->orientation.y;
+	const float qz = pose->orientation.z;
+	const float qw = pose->orientation.w;
+
+	dir->x = -2.0f * ((qx * qz) + (qw * qy));
+	dir->y = -2.0f * ((qy * qz) - (qw * qx));
+	dir->z = -1.0f + (2.0f * ((qx * qx) + (qy * qy)));
+}
+
+static int intersect_ray(
+	const XrPosef *pose,
+	const ScreenRect *rect,
+	float *resultX,
+	float *resultY
+) {
+	const float (*m)[4] = rect->mapping;
+	XrVector3f dir, hit;
+	float u, v, w;
+
+	pose_direction(pose, &dir);
+
+	/* Solve dot(normal, position + t * dir) == planeDist. A ray that is
+	 * parallel to the plane or facing away from it (t <= 0) never hits the
+	 * rect. Rather than dividing and then checking t, check the signs first
+	 * so that nothing is divided on the miss path.
+	 */
+	const float dist = rect->planeDist - vec3_dot(&rect->normal, &pose->position);
+	const float facing = vec3_dot(&rect->normal, &dir);
+	if ((dist * facing) <= 0.0f)
+	{
+		return 0;
+	}
+	const float t = dist / facing;
+
+	hit.x = pose->position.x + (t * dir.x);
+	hit.y = pose->position.y + (t * dir.y);
+	hit.z = pose->position.z + (t * dir.z);
+
+	/* Plane -> screen */
+	u = (m[0][0] * hit.x) + (m[0][1] * hit.y) + (m[0][2] * hit.z) + m[0][3];
+	v = (m[1][0] * hit.x) + (m[1][1] * hit.y) + (m[1][2] * hit.z) + m[1][3];
+	w = (m[2][0] * hit.x) + (m[2][1] * hit.y) + (m[2][2] * hit.z) + m[2][3];
+	if (w <= 0.0f)
+	{
+		return 0;
+	}
+	w = 1.0f / w;
+	*resultX = u * w;
+	*resultY = v * w;
+	return 1;
+}
+
+/* Given a pose with position/orientation and the calibrated screen rects,
+ * screens_to_pointer (below) attempts to find where a ray casted by the pose
+ * intersects with a rect, then normalizes the result to that rect's target.
+ *
+ * For example, with one screen, a pose pointing directly at the center of the
+ * rectangle will evaluate to [0.5, 0.5].
+ *
+ * When the ray does NOT point at any rectangle (i.e. it's parallel to or facing
+ * away from it) the result is discarded entirely.
+ *
+ * When the result is valid AND newer than the current values of mouseX/mouseY,
+ * the result is written to mouseX/mouseY and the function returns
+ * POINTER_MOVED. Otherwise, mouseX/mouseY are still valid, and the function
+ * returns POINTER_MISS if the ray is off every rect or POINTER_SAME if it's on
+ * one but hasn't moved. The miss is what offscreen detection runs on.
+ */
+typedef enum PointerResult
+{
+	POINTER_MISS,
+	POINTER_SAME,
+	POINTER_MOVED
+} PointerResult;
+
+/* Note that the bounds check also throws out NaN */
+static int pointer_on_rect(float x, float y)
+{
+	return x >= 0 && x <= 1 && y >= 0 && y <= 1;
+}
+
+/* The second half of screens_to_pointer, for results that were already mapped */
+static PointerResult pointer_update(
+	int hit,
+	float resultX,
+	float resultY,
+	float *mouseX,
+	float *mouseY
+) {
+	if (!hit || !pointer_on_rect(resultX, resultY))
+	{
+		return POINTER_MISS;
+	}
+	if ((resultX != *mouseX) || (resultY != *mouseY))
+	{
+		*mouseX = resultX;
+		*mouseY = resultY;
+		return POINTER_MOVED;
+	}
+	return POINTER_SAME;
+}
+
+/* Multiple screens. Triple-screen cabinets and separate hit regions (a
+ * marquee, say) are each their own calibrated rect, and each rect has a
+ * target: the part of the --screen it maps to, see --target. With one screen
+ * the target is the whole --screen, which is what a single rect always did.
+ *
+ * Looking up which rect a ray hits shouldn't cost a full intersection per
+ * rect, so screens_prepare puts a bounding sphere around each one:
+ *
+ * - The rect the gun hit last is tried first. A gun spends nearly all its time
+ *   on one screen, so most lookups are one intersection however many rects
+ *   there are.
+ * - Every other rect is only intersected if the ray passes through its sphere,
+ *   which is a couple of dot products. MAPPING_LEGACY doesn't cast a real ray,
+ *   so it skips this and tries each rect in turn.
+ */
+#define MAX_SCREENS 4
+
+typedef struct Screens
+{
+	ScreenRect rects[MAX_SCREENS];
+	int count;
+	float targets[MAX_SCREENS][4]; /* x, y, width, height, normalized to the --screen */
+
+	/* From screens_prepare, once every rect is calibrated */
+	XrVector3f centers[MAX_SCREENS];
+	float radii[MAX_SCREENS]; /* Squared */
+} Screens;
+
+/* screen_rect_calibrate fills in all 4 corners, whatever it was given */
+static void screens_prepare(Screens *screens)
+{
+	int i, j;
+
+	for (i = 0; i < screens->count; i += 1)
+	{
+		const XrVector3f *c = screens->rects[i].corners;
+		float radius = 0.0f;
+
+		screens->centers[i].x = (c[0].x + c[1].x + c[2].x + c[3].x) * 0.25f;
+		screens->centers[i].y = (c[0].y + c[1].y + c[2].y + c[3].y) * 0.25f;
+		screens->centers[i].z = (c[0].z + c[1].z + c[2].z + c[3].z) * 0.25f;
+		for (j = 0; j < 4; j += 1)
+		{
+			const XrVector3f offset = vec3_sub(&c[j], &screens->centers[i]);
+			const float distance = vec3_dot(&offset, &offset);
+			radius = (distance > radius) ? distance : radius;
+		}
+
+		/* A little slack, so rounding never culls a hit on the very edge */
+		screens->radii[i] = radius * 1.01f;
+	}
+}
+
+static int screens_ray_near(
+	const Screens *screens,
+	int index,
+	const XrVector3f *position,
+	const XrVector3f *dir
+) {
+	const XrVector3f offset = vec3_sub(&screens->centers[index], position);
+	const float along = vec3_dot(&offset, dir);
+	const float distance = vec3_dot(&offset, &offset);
+
+	if (along < 0.0f)
+	{
+		/* Pointing away, which only hits if the gun is inside the sphere */
+		return distance <= screens->radii[index];
+	}
+	return (distance - (along * along)) <= screens->radii[index];
+}
+
+/* From a rect's own [0, 1] to its target on the --screen */
+static void screens_to_target(
+	const Screens *screens,
+	int index,
+	float *x,
+	float *y
+) {
+	const float *target = screens->targets[index];
+	*x = target[0] + (*x * target[2]);
+	*y = target[1] + (*y * target[3]);
+}
+
+/* The slow path of screens_to_pointer: every rect but skip, which already
+ * missed. Returns the rect that was hit or -1, with the result normalized to
+ * that rect rather than its target.
+ */
+static int screens_find(
+	const Screens *screens,
+	const MappingMode mode,
+	const XrPosef *pose,
+	int skip,
+	float *resultX,
+	float *resultY
+) {
+	XrVector3f dir;
+	int index, hit;
+
+	pose_direction(pose, &dir);
+	for (index = 0; index < screens->count; index += 1)
+	{
+		if (index == skip)
+		{
+			continue;
+		}
+		if (mode == MAPPING_LEGACY)
+		{
+			hit = intersect_legacy(pose, &screens->rects[index], resultX, resultY);
+		}
+		else
+		{
+			hit = (	screens_ray_near(screens, index, &pose->position, &dir) &&
+				intersect_ray(pose, &screens->rects[index], resultX, resultY)	);
+		}
+		if (hit && pointer_on_rect(*resultX, *resultY))
+		{
+			return index;
+		}
+	}
+	return -1;
+}
+
+/* See PointerResult. *screen is the rect that was hit last, and is updated
+ * when the pose moves to another one.
+ */
+static PointerResult screens_to_pointer(
+	const Screens *screens,
+	const MappingMode mode,
+	const XrPosef *pose,
+	int *screen,
+	float *mouseX,
+	float *mouseY
+) {
+	float resultX, resultY;
+	int index = *screen;
+	int hit;
+
+	/* The usual case, still on the same rect as last time */
+	if (mode == MAPPING_LEGACY)
+	{
+		hit = intersect_legacy(pose, &screens->rects[index], &resultX, &resultY);
+	}
+	else
+	{
+		hit = intersect_ray(pose, &screens->rects[index], &resultX, &resultY);
+	}
+	if (!hit || !pointer_on_rect(resultX, resultY))
+	{
+		if (screens->count == 1)
+		{
+			return POINTER_MISS;
+		}
+		index = screens_find(screens, mode, pose, index, &resultX, &resultY);
+		if (index < 0)
+		{
+			return POINTER_MISS;
+		}
+		*screen = index;
+	}
+	screens_to_target(screens, index, &resultX, &resultY);
+	return pointer_update(1, resultX, resultY, mouseX, mouseY);
+}
+
+/* Batched MAPPING_RAY, for when there are a lot of poses to map at once (all
+ * the guns in an iteration, sub-frame time slices, trace replays). The poses
+ * go in as a structure of arrays so that four of them can be mapped at once
+ * with SSE or NEON; anything else gets the same math one pose at a time.
+ *
+ * Unlike screens_to_pointer, this doesn't track the pointer: hits says which
+ * slots intersected the plane, and pointer_update does the bounds check and
+ * decides what counts as moved.
+ * The outputs must have room for POSE_BATCH_SIZE results, and the poses are
+ * read rounded up to a multiple of 4, so pad the batch with anything. The
+ * results match intersect_ray to within rounding.
+ */
+#define POSE_BATCH_SIZE 16 /* Must be a multiple of 4 */
+
+typedef struct PoseBatch
+{
+	int count;
+	float px[POSE_BATCH_SIZE], py[POSE_BATCH_SIZE], pz[POSE_BATCH_SIZE];
+	float qx[POSE_BATCH_SIZE], qy[POSE_BATCH_SIZE], qz[POSE_BATCH_SIZE], qw[POSE_BATCH_SIZE];
+} PoseBatch;
+
+static void pose_batch_set(PoseBatch *batch, int index, const XrPosef *pose)
+{
+	batch->px[index] = pose->position.x;
+	batch->py[index] = pose->position.y;
+	batch->pz[index] = pose->position.z;
+	batch->qx[index] = pose->orientation.x;
+	batch->qy[index] = pose->orientation.y;
+	batch->qz[index] = pose->orientation.z;
+	batch->qw[index] = pose->orientation.w;
+}
+
+#if defined(__SSE__)
+typedef __m128 vec4;
+#define VEC4_LOAD(p) _mm_loadu_ps(p)
+#define VEC4_STORE(p, v) _mm_storeu_ps(p, v)
+#define VEC4_SET(x) _mm_set1_ps(x)
+#define VEC4_ADD(a, b) _mm_add_ps(a, b)
+#define VEC4_SUB(a, b) _mm_sub_ps(a, b)
+#define VEC4_MUL(a, b) _mm_mul_ps(a, b)
+#define VEC4_DIV(a, b) _mm_div_ps(a, b)
+#define HAVE_VEC4
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+typedef float32x4_t vec4;
+#define VEC4_LOAD(p) vld1q_f32(p)
+#define VEC4_STORE(p, v) vst1q_f32(p, v)
+#define VEC4_SET(x) vdupq_n_f32(x)
+#define VEC4_ADD(a, b) vaddq_f32(a, b)
+#define VEC4_SUB(a, b) vsubq_f32(a, b)
+#define VEC4_MUL(a, b) vmulq_f32(a, b)
+#define VEC4_DIV(a, b) vdivq_f32(a, b)
+#define HAVE_VEC4
+#endif
+
+static void pose_batch_to_pointer(
+	const PoseBatch *batch,
+	const ScreenRect *rect,
+	float *resultX,
+	float *resultY,
+	uint8_t *hits
+) {
+	int i;
+
+#ifdef HAVE_VEC4
+	const float (*m)[4] = rect->mapping;
+	float facing[4], dist[4], w[4];
+	int lane;
+
+	/* Same steps as intersect_ray, with the hit test left for the end so
+	 * the lanes never branch. Misses can divide by zero, but those lanes
+	 * are thrown out anyway.
+	 */
+	for (i = 0; i < batch->count; i += 4)
+	{
+		const vec4 one = VEC4_SET(1.0f);
+		const vec4 two = VEC4_SET(2.0f);
+		const vec4 qx = VEC4_LOAD(&batch->qx[i]);
+		const vec4 qy = VEC4_LOAD(&batch->qy[i]);
+		const vec4 qz = VEC4_LOAD(&batch->qz[i]);
+		const vec4 qw = VEC4_LOAD(&batch->qw[i]);
+		const vec4 px = VEC4_LOAD(&batch->px[i]);
+		const vec4 py = VEC4_LOAD(&batch->py[i]);
+		const vec4 pz = VEC4_LOAD(&batch->pz[i]);
+
+		const vec4 dirX = VEC4_MUL(
+			VEC4_SET(-2.0f),
+			VEC4_ADD(VEC4_MUL(qx, qz), VEC4_MUL(qw, qy))
+		);
+		const vec4 dirY = VEC4_MUL(
+			VEC4_SET(-2.0f),
+			VEC4_SUB(VEC4_MUL(qy, qz), VEC4_MUL(qw, qx))
+		);
+		const vec4 dirZ = VEC4_ADD(
+			VEC4_SET(-1.0f),
+			VEC4_MUL(two, VEC4_ADD(VEC4_MUL(qx, qx), VEC4_MUL(qy, qy)))
+		);
+
+		const vec4 nx = VEC4_SET(rect->normal.x);
+		const vec4 ny = VEC4_SET(rect->normal.y);
+		const vec4 nz = VEC4_SET(rect->normal.z);
+		const vec4 d = VEC4_SUB(
+			VEC4_SET(rect->planeDist),
+			VEC4_ADD(VEC4_ADD(VEC4_MUL(nx, px), VEC4_MUL(ny, py)), VEC4_MUL(nz, pz))
+		);
+		const vec4 f = VEC4_ADD(
+			VEC4_ADD(VEC4_MUL(nx, dirX), VEC4_MUL(ny, dirY)),
+			VEC4_MUL(nz, dirZ)
+		);
+		const vec4 t = VEC4_DIV(d, f);
+
+		const vec4 hx = VEC4_ADD(px, VEC4_MUL(t, dirX));
+		const vec4 hy = VEC4_ADD(py, VEC4_MUL(t, dirY));
+		const vec4 hz = VEC4_ADD(pz, VEC4_MUL(t, dirZ));
+
+		#define PLANE_TO_SCREEN(row) VEC4_ADD( \
+			VEC4_ADD( \
+				VEC4_ADD( \
+					VEC4_MUL(VEC4_SET(m[row][0]), hx), \
+					VEC4_MUL(VEC4_SET(m[row][1]), hy) \
+				), \
+				VEC4_MUL(VEC4_SET(m[row][2]), hz) \
+			), \
+			VEC4_SET(m[row][3]) \
+		)
+		const vec4 u = PLANE_TO_SCREEN(0);
+		const vec4 v = PLANE_TO_SCREEN(1);
+		const vec4 ww = PLANE_TO_SCREEN(2);
+		#undef PLANE_TO_SCREEN
+
+		const vec4 rw = VEC4_DIV(one, ww);
+		VEC4_STORE(&resultX[i], VEC4_MUL(u, rw));
+		VEC4_STORE(&resultY[i], VEC4_MUL(v, rw));
+		VEC4_STORE(dist, d);
+		VEC4_STORE(facing, f);
+		VEC4_STORE(w, ww);
+
+		for (lane = 0; lane < 4; lane += 1)
+		{
+			hits[i + lane] = ((dist[lane] * facing[lane]) > 0.0f) && (w[lane] > 0.0f);
+		}
+	}
+#else
+	for (i = 0; i < batch->count; i += 1)
+	{
+		XrPosef pose;
+		pose.position.x = batch->px[i];
+		pose.position.y = batch->py[i];
+		pose.position.z = batch->pz[i];
+		pose.orientation.x = batch->qx[i];
+		pose.orientation.y = batch->qy[i];
+		pose.orientation.z = batch->qz[i];
+		pose.orientation.w = batch->qw[i];
+		hits[i] = intersect_ray(&pose, rect, &resultX[i], &resultY[i]);
+	}
+#endif
+}
+
+/* Calibration is cached on disk so that restarts can go straight to PLAYING.
+ *
+ * The cache is keyed on the runtime, the tracking system and the size of the
+ * stage bounds: if any of those change, the stage origin almost certainly moved
+ * and the stored corners are meaningless. Use --recalibrate to ignore the
+ * cache anyway, i.e. when the screen or the base stations were moved.
+ *
+ * The file is just this struct, so it's only valid for the build that wrote
+ * it; the size and version fields make sure of that.
+ */
+#define CALIBRATION_MAGIC 0x5258474C /* 'LGXR' */
+#define CALIBRATION_VERSION 2 /* 2: More than one screen */
+
+typedef struct CalibrationKey
+{
+	char runtimeName[XR_MAX_RUNTIME_NAME_SIZE];
+	XrVersion runtimeVersion;
+	char systemName[XR_MAX_SYSTEM_NAME_SIZE];
+	uint32_t vendorId;
+	XrExtent2Df stageBounds;
+} CalibrationKey;
+
+typedef struct CalibrationCache
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	uint32_t checksum; /* FNV-1a of key + rects */
+	CalibrationKey key;
+	uint32_t screenCount;
+	ScreenRect rects[MAX_SCREENS];
+} CalibrationCache;
+
+static uint32_t calibration_checksum(const CalibrationCache *cache)
+{
+	const uint8_t *data = (const uint8_t*) &cache->key;
+	const size_t len = sizeof(CalibrationCache) - offsetof(CalibrationCache, key);
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; i += 1)
+	{
+		hash = (hash ^ data[i]) * 16777619u;
+	}
+	return hash;
+}
+
+static void calibration_default_path(char *path, size_t len)
+{
+	const char *dir = getenv("XDG_CACHE_HOME");
+	if (dir != NULL && dir[0] != '\0')
+	{
+		snprintf(path, len, "%s/lightgunxr.cal", dir);
+		return;
+	}
+	dir = getenv("HOME");
+	if (dir != NULL && dir[0] != '\0')
+	{
+		snprintf(path, len, "%s/.cache/lightgunxr.cal", dir);
+		return;
+	}
+	snprintf(path, len, "lightgunxr.cal");
+}
+
+/* Returns 1 and fills in the rects if the cache at path matches key and has
+ * as many screens as we're expecting
+ */
+static int calibration_load(
+	const char *path,
+	const CalibrationKey *key,
+	Screens *screens
+) {
+	const CalibrationCache *cache;
+	struct stat st;
+	int fd, valid;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+	{
+		return 0;
+	}
+	if (fstat(fd, &st) == -1 || st.st_size != sizeof(CalibrationCache))
+	{
+		close(fd);
+		return 0;
+	}
+	cache = (const CalibrationCache*) mmap(
+		NULL,
+		sizeof(CalibrationCache),
+		PROT_READ,
+		MAP_PRIVATE,
+		fd,
+		0
+	);
+	close(fd);
+	if (cache == MAP_FAILED)
+	{
+		return 0;
+	}
+
+	valid = (	cache->magic == CALIBRATION_MAGIC &&
+			cache->version == CALIBRATION_VERSION &&
+			cache->size == sizeof(CalibrationCache) &&
+			cache->checksum == calibration_checksum(cache) &&
+			memcmp(&cache->key, key, sizeof(CalibrationKey)) == 0 &&
+			cache->screenCount == (uint32_t) screens->count	);
+	if (valid)
+	{
+		memcpy(screens->rects, cache->rects, sizeof(screens->rects));
+	}
+
+	munmap((void*) cache, sizeof(CalibrationCache));
+	return valid;
+}
+
+static void calibration_save(
+	const char *path,
+	const CalibrationKey *key,
+	const Screens *screens
+) {
+	CalibrationCache cache;
+	char tmpPath[4096];
+	int fd;
+	ssize_t written;
+
+	memset(&cache, '\0', sizeof(cache));
+	cache.magic = CALIBRATION_MAGIC;
+	cache.version = CALIBRATION_VERSION;
+	cache.size = sizeof(CalibrationCache);
+	cache.key = *key;
+	cache.screenCount = screens->count;
+	memcpy(cache.rects, screens->rects, sizeof(cache.rects));
+	cache.checksum = calibration_checksum(&cache);
+
+	/* Write to a temp file and rename, so a crash never leaves half a file */
+	snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+	fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+	{
+		printf("Could not save calibration to %s: %s\n", path, strerror(errno));
+		return;
+	}
+	written = write(fd, &cache, sizeof(cache));
+	close(fd);
+	if (written != sizeof(cache) || rename(tmpPath, path) == -1)
+	{
+		printf("Could not save calibration to %s: %s\n", path, strerror(errno));
+		unlink(tmpPath);
+		return;
+	}
+	printf("Calibration saved to %s\n", path);
+}
+
+/* The loop is paced against absolute deadlines on CLOCK_MONOTONIC rather than
+ * sleeping a fixed amount after each iteration, so the time spent in the
+ * runtime doesn't get added on top of the period.
+ *
+ * XR_MND_headless has no xrWaitFrame, so there's no predicted display time to
+ * line up with; instead we poll at a target rate that should match (or be a
+ * multiple of) the runtime's pose update rate.
+ *
+ * While the session is not focused there is nothing to do, so the period is
+ * doubled every iteration up to MAX_IDLE_PERIOD_NS. The first focused sync puts
+ * us right back on the target rate.
+ *
+ * So that a long idle period doesn't delay that first sync, an idle wait can
+ * also be cut short by posting the pacer's wake semaphore: the service thread
+ * does that when the session gets focus. A post that lands while we're still
+ * focused would cut the next idle stretch short for nothing, so whatever piled
+ * up is thrown away when the idling starts.
+ */
+#define DEFAULT_POLL_RATE 1000
+#define MAX_IDLE_PERIOD_NS 100000000L /* 100ms */
+#define NS_PER_SEC 1000000000L
+
+typedef struct Pacer
+{
+	struct timespec next;
+	long periodNS;
+	long idlePeriodNS;
+	sem_t *wake; /* Optional, see above */
+} Pacer;
+
+static void timespec_add_ns(struct timespec *ts, long ns)
+{
+	ts->tv_nsec += ns;
+	while (ts->tv_nsec >= NS_PER_SEC)
+	{
+		ts->tv_nsec -= NS_PER_SEC;
+		ts->tv_sec += 1;
+	}
+}
+
+static int timespec_before(const struct timespec *a, const struct timespec *b)
+{
+	return (a->tv_sec < b->tv_sec) || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static void pacer_init(Pacer *pacer, int rate, sem_t *wake)
+{
+	pacer->periodNS = NS_PER_SEC / rate;
+	pacer->idlePeriodNS = pacer->periodNS;
+	pacer->wake = wake;
+	clock_gettime(CLOCK_MONOTONIC, &pacer->next);
+}
+
+static void pacer_wait(Pacer *pacer, int focused)
+{
+	struct timespec now;
+
+	if (focused)
+	{
+		pacer->idlePeriodNS = pacer->periodNS;
+	}
+	else
+	{
+		if (pacer->idlePeriodNS == pacer->periodNS && pacer->wake != NULL)
+		{
+			/* Just started idling, anything posted until now is stale */
+			while (sem_trywait(pacer->wake) == 0);
+		}
+		if (pacer->idlePeriodNS < MAX_IDLE_PERIOD_NS)
+		{
+			pacer->idlePeriodNS *= 2;
+			if (pacer->idlePeriodNS > MAX_IDLE_PERIOD_NS)
+			{
+				pacer->idlePeriodNS = MAX_IDLE_PERIOD_NS;
+			}
+		}
+	}
+
+	timespec_add_ns(&pacer->next, pacer->idlePeriodNS);
+
+	/* If we fell behind, don't try to catch up with a burst of iterations */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (timespec_before(&pacer->next, &now))
+	{
+		pacer->next = now;
+		return;
+	}
+
+	if (!focused && pacer->wake != NULL)
+	{
+		int woken;
+		while (	(woken = sem_clockwait(pacer->wake, CLOCK_MONOTONIC, &pacer->next)) == -1 &&
+			errno == EINTR	);
+		if (woken == 0)
+		{
+			/* Something happened, go check right away */
+			pacer->idlePeriodNS = pacer->periodNS;
+			clock_gettime(CLOCK_MONOTONIC, &pacer->next);
+		}
+		return;
+	}
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &pacer->next, NULL) == EINTR);
+}
+
+/* Pointer filtering.
+ *
+ * Tracker jitter goes straight to the crosshair, so the mapped pointer can be
+ * run through a One Euro filter (Casiez et al., CHI 2012): a low-pass whose
+ * cutoff rises with the pointer's speed. Holding still gets heavy smoothing,
+ * fast movement gets almost none, so the lag only shows up where it can't be
+ * seen.
+ *
+ * --filter-min-cutoff is the cutoff at rest: lower is less jitter but more lag
+ * on slow movement. --filter-beta is how fast the cutoff opens up with speed,
+ * in Hz per screen/second since the pointer is normalized.
+ *
+ * The state is a fixed struct per gun, there's nothing to allocate.
+ */
+#define DEFAULT_FILTER_MIN_CUTOFF 1.0f
+#define DEFAULT_FILTER_BETA 20.0f
+#define FILTER_DERIVATIVE_CUTOFF 1.0f
+#define FILTER_RESET_NS 100000000 /* 100ms, start over after a gap this long */
+
+typedef enum FilterMode
+{
+	FILTER_NONE,
+	FILTER_ONE_EURO
+} FilterMode;
+
+typedef struct FilterParams
+{
+	FilterMode mode;
+	float minCutoff; /* Hz */
+	float beta;
+} FilterParams;
+
+typedef struct PointerFilter
+{
+	float x, y; /* Filtered pointer */
+	float dx, dy; /* Filtered speed */
+	uint64_t lastTime;
+	int primed;
+} PointerFilter;
+
+static float filter_alpha(float cutoff, float dt)
+{
+	const float tau = 1.0f / (2.0f * (float) M_PI * cutoff);
+	return 1.0f / (1.0f + (tau / dt));
+}
+
+static void filter_reset(PointerFilter *filter)
+{
+	filter->primed = 0;
+}
+
+/* Filters x/y in place. time is in nanoseconds and only needs to be monotonic */
+static void filter_apply(
+	PointerFilter *filter,
+	const FilterParams *params,
+	uint64_t time,
+	float *x,
+	float *y
+) {
+	float dt, alpha, speed;
+
+	if (!filter->primed || (time - filter->lastTime) > FILTER_RESET_NS)
+	{
+		filter->x = *x;
+		filter->y = *y;
+		filter->dx = 0;
+		filter->dy = 0;
+		filter->lastTime = time;
+		filter->primed = 1;
+		return;
+	}
+	if (time <= filter->lastTime)
+	{
+		*x = filter->x;
+		*y = filter->y;
+		return;
+	}
+	dt = (time - filter->lastTime) / (float) NS_PER_SEC;
+	filter->lastTime = time;
+
+	/* The speed is smoothed too, with a fixed cutoff */
+	alpha = filter_alpha(FILTER_DERIVATIVE_CUTOFF, dt);
+	filter->dx += alpha * (((*x - filter->x) / dt) - filter->dx);
+	filter->dy += alpha * (((*y - filter->y) / dt) - filter->dy);
+	speed = sqrtf((filter->dx * filter->dx) + (filter->dy * filter->dy));
+
+	alpha = filter_alpha(params->minCutoff + (params->beta * speed), dt);
+	filter->x += alpha * (*x - filter->x);
+	filter->y += alpha * (*y - filter->y);
+	*x = filter->x;
+	*y = filter->y;
+}
+
+/* Upsampling.
+ *
+ * Trackers don't update as often as we poll: between updates the runtime can
+ * hand back the same pose over and over, so the pointer moves in steps at the
+ * tracker's rate no matter how fast the game reads the mouse. With --upsample,
+ * the aim pose's velocity is located along with it, and while the pose is
+ * stale it gets extrapolated from the last fresh one, at most --upsample times
+ * per second. A fresh pose always wins. Past UPSAMPLE_MAX_NS the tracker has
+ * probably lost the gun, so the pose is held instead of flying off.
+ */
+#define UPSAMPLE_MAX_NS 20000000 /* 20ms */
+
+typedef struct PoseVelocity
+{
+	XrSpaceVelocityFlags flags;
+	XrVector3f linear;
+	XrVector3f angular; /* Radians per second, in the base space */
+} PoseVelocity;
+
+/* Moves a pose along its velocity for dt seconds */
+static void pose_extrapolate(
+	const XrPosef *pose,
+	const PoseVelocity *velocity,
+	float dt,
+	XrPosef *result
+) {
+	*result = *pose;
+	if (velocity->flags & XR_SPACE_VELOCITY_LINEAR_VALID_BIT)
+	{
+		result->position.x += velocity->linear.x * dt;
+		result->position.y += velocity->linear.y * dt;
+		result->position.z += velocity->linear.z * dt;
+	}
+	if (velocity->flags & XR_SPACE_VELOCITY_ANGULAR_VALID_BIT)
+	{
+		/* Rotate by the small-angle quaternion (w * dt / 2, 1), on the
+		 * left since the angular velocity is in the base space
+		 */
+		const float hx = velocity->angular.x * dt * 0.5f;
+		const float hy = velocity->angular.y * dt * 0.5f;
+		const float hz = velocity->angular.z * dt * 0.5f;
+		const XrQuaternionf *q = &pose->orientation;
+		XrQuaternionf r;
+		float length;
+
+		r.x = q->x + (hx * q->w) + (hy * q->z) - (hz * q->y);
+		r.y = q->y - (hx * q->z) + (hy * q->w) + (hz * q->x);
+		r.z = q->z + (hx * q->y) - (hy * q->x) + (hz * q->w);
+		r.w = q->w - (hx * q->x) - (hy * q->y) - (hz * q->z);
+		length = sqrtf((r.x * r.x) + (r.y * r.y) + (r.z * r.z) + (r.w * r.w));
+		if (length > 0.0f)
+		{
+			length = 1.0f / length;
+			result->orientation.x = r.x * length;
+			result->orientation.y = r.y * length;
+			result->orientation.z = r.z * length;
+			result->orientation.w = r.w * length;
+		}
+	}
+}
+
+/* Latency instrumentation.
+ *
+ * The sampler timestamps each stage of an iteration with CLOCK_MONOTONIC and
+ * records the durations into log-linear ("HDR") histograms: values are bucketed
+ * by their highest set bit, and each power of two is split into
+ * HISTOGRAM_SUB_COUNT linear sub-buckets. That keeps the relative error under
+ * ~3% everywhere from nanoseconds to seconds, at a fixed size and with no
+ * allocation.
+ *
+ * Every histogram has exactly one writer: the sampler, except for the kick and
+ * pose-to-evdev stages which are written by the service thread. The counters
+ * are atomics so that the service thread can read them at any time, but
+ * they're updated with plain relaxed loads/stores instead of
+ * read-modify-writes, so recording stays cheap. A report taken mid-iteration
+ * may be off by a sample, which is fine.
+ *
+ * Send SIGUSR1 to print a report, or ask the --control socket for one.
+ */
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+typedef enum Stage
+{
+	STAGE_SYNC, /* xrSyncActions */
+	STAGE_LOCATE, /* Time conversion + xrLocateSpace */
+	STAGE_ACTIONS, /* xrGetActionStateBoolean */
+	STAGE_MAP, /* screens_to_pointer */
+	STAGE_EMIT, /* uinput write */
+	STAGE_POSE_TO_UINPUT, /* Pose sample time -> write done */
+	STAGE_POSE_TO_EVDEV, /* Pose sample time -> evdev timestamp, --latency-test only */
+	STAGE_KICK, /* Fire sample time -> xrApplyHapticFeedback done */
+	STAGE_ITERATION, /* Start of xrSyncActions -> end of iteration */
+	STAGE_COUNT
+} Stage;
+
+static const char *stageNames[STAGE_COUNT] =
+{
+	"sync",
+	"locate",
+	"actions",
+	"map",
+	"emit",
+	"pose-to-uinput",
+	"pose-to-evdev",
+	"kick",
+	"iteration"
+};
+
+typedef struct Histogram
+{
+	atomic_uint buckets[HISTOGRAM_BUCKETS];
+	atomic_uint count;
+	atomic_uint max; /* Clamped to ~4s */
+} Histogram;
+
+/* Plain event counts, same single-writer rules as the histograms */
+typedef enum Counter
+{
+	COUNTER_ABS_SENT, /* ABS events written */
+	COUNTER_ABS_SUPPRESSED, /* ABS events skipped, unchanged or within the deadband */
+	COUNTER_POINTER_MISSES, /* Samples where the ray was off the rect */
+	COUNTER_OFFSCREEN, /* Times a gun went offscreen */
+	COUNTER_UPSAMPLED, /* Samples with an extrapolated pose */
+	COUNTER_UNTRACKED, /* Samples thrown out for their location flags */
+	COUNTER_TRACKING_LOST, /* Times a gun lost tracking */
+	COUNTER_SHOT_POSES, /* Shots aimed with the pose from the trigger break */
+	COUNTER_SHOT_POSE_MISSES, /* Shots that kept the usual pose, see --shot-pose */
+	COUNTER_COUNT
+} Counter;
+
+static const char *counterNames[COUNTER_COUNT] =
+{
+	"abs-sent",
+	"abs-suppressed",
+	"pointer-misses",
+	"offscreen",
+	"upsampled",
+	"untracked",
+	"tracking-lost",
+	"shot-poses",
+	"shot-pose-misses"
+};
+
+typedef struct Stats
+{
+	Histogram stages[STAGE_COUNT];
+	atomic_uint counters[COUNTER_COUNT];
+} Stats;
+
+static uint64_t timespec_ns(const struct timespec *ts)
+{
+	return ((uint64_t) ts->tv_sec * NS_PER_SEC) + ts->tv_nsec;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return timespec_ns(&ts);
+}
+
+static int histogram_index(uint64_t value)
+{
+	int msb;
+
+	if (value < HISTOGRAM_SUB_COUNT)
+	{
+		return (int) value;
+	}
+	msb = 63 - __builtin_clzll(value);
+	return (
+		((msb - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT) +
+		(int) ((value >> (msb - HISTOGRAM_SUB_BITS)) - HISTOGRAM_SUB_COUNT)
+	);
+}
+
+/* Returns the upper bound of the values that land in bucket index */
+static uint64_t histogram_value(int index)
+{
+	int shift;
+
+	if (index < HISTOGRAM_SUB_COUNT)
+	{
+		return index;
+	}
+	shift = (index / HISTOGRAM_SUB_COUNT) - 1;
+	return (
+		((uint64_t) (HISTOGRAM_SUB_COUNT + (index % HISTOGRAM_SUB_COUNT)) << shift) +
+		((1ull << shift) - 1)
+	);
+}
+
+static void histogram_record(Histogram *histogram, uint64_t value)
+{
+	atomic_uint *bucket = &histogram->buckets[histogram_index(value)];
+	const unsigned int clamped = (value > 0xFFFFFFFFull) ? 0xFFFFFFFFu : (unsigned int) value;
+
+	#define INCREMENT(a) \
+		atomic_store_explicit(a, atomic_load_explicit(a, memory_order_relaxed) + 1, memory_order_relaxed);
+	INCREMENT(bucket)
+	INCREMENT(&histogram->count)
+	#undef INCREMENT
+
+	if (clamped > atomic_load_explicit(&histogram->max, memory_order_relaxed))
+	{
+		atomic_store_explicit(&histogram->max, clamped, memory_order_relaxed);
+	}
+}
+
+static void counter_add(Stats *stats, Counter counter, unsigned int count)
+{
+	atomic_uint *value = &stats->counters[counter];
+	atomic_store_explicit(
+		value,
+		atomic_load_explicit(value, memory_order_relaxed) + count,
+		memory_order_relaxed
+	);
+}
+
+static uint64_t histogram_percentile(Histogram *histogram, double percentile)
+{
+	const unsigned int count = atomic_load_explicit(&histogram->count, memory_order_relaxed);
+	const unsigned int target = (unsigned int) (count * (percentile / 100.0));
+	unsigned int seen = 0;
+	int i;
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; i += 1)
+	{
+		seen += atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+		if (seen > target)
+		{
+			return histogram_value(i);
+		}
+	}
+	return atomic_load_explicit(&histogram->max, memory_order_relaxed);
+}
+
+static void stats_init(Stats *stats)
+{
+	int stage, i;
+
+	for (stage = 0; stage < STAGE_COUNT; stage += 1)
+	{
+		Histogram *histogram = &stats->stages[stage];
+		for (i = 0; i < HISTOGRAM_BUCKETS; i += 1)
+		{
+			atomic_init(&histogram->buckets[i], 0);
+		}
+		atomic_init(&histogram->count, 0);
+		atomic_init(&histogram->max, 0);
+	}
+	for (i = 0; i < COUNTER_COUNT; i += 1)
+	{
+		atomic_init(&stats->counters[i], 0);
+	}
+}
+
+static void stats_report(Stats *stats, FILE *out)
+{
+	int stage;
+
+	fprintf(out, "%-16s %10s %10s %10s %10s %10s\n", "stage (us)", "samples", "p50", "p99", "p99.9", "max");
+	for (stage = 0; stage < STAGE_COUNT; stage += 1)
+	{
+		Histogram *histogram = &stats->stages[stage];
+		fprintf(
+			out,
+			"%-16s %10u %10.1f %10.1f %10.1f %10.1f\n",
+			stageNames[stage],
+			atomic_load_explicit(&histogram->count, memory_order_relaxed),
+			histogram_percentile(histogram, 50.0) / 1000.0,
+			histogram_percentile(histogram, 99.0) / 1000.0,
+			histogram_percentile(histogram, 99.9) / 1000.0,
+			atomic_load_explicit(&histogram->max, memory_order_relaxed) / 1000.0
+		);
+	}
+	for (stage = 0; stage < COUNTER_COUNT; stage += 1)
+	{
+		fprintf(
+			out,
+			"%-16s %10u\n",
+			counterNames[stage],
+			atomic_load_explicit(&stats->counters[stage], memory_order_relaxed)
+		);
+	}
+
+	/* The typical pipeline delay is what --lookahead should hide. Whatever
+	 * the game and display add on top of evdev isn't something we can see.
+	 */
+	if (atomic_load_explicit(&stats->stages[STAGE_POSE_TO_EVDEV].count, memory_order_relaxed) > 0)
+	{
+		fprintf(
+			out,
+			"Suggested --lookahead: %.1f ms, plus the game's own input-to-display latency\n",
+			histogram_percentile(&stats->stages[STAGE_POSE_TO_EVDEV], 50.0) / 1000000.0
+		);
+	}
+}
+
+/* Log verbosity. Anything above the selected level is thrown out by the
+ * sampler before it ever reaches the ring, so a quiet log costs nothing on the
+ * hot path.
+ */
+typedef enum LogLevel
+{
+	LOG_ERROR,
+	LOG_WARNING,
+	LOG_INFO,
+	LOG_DEBUG
+} LogLevel;
+
+static const char *logLevelNames[] =
+{
+	"error",
+	"warning",
+	"info",
+	"debug"
+};
+
+/* Command line options */
+
+#define DEFAULT_SAMPLER_PRIORITY 10
+#define DEFAULT_POINTER_LOG_RATE 10
+#define DEFAULT_KICK_AMPLITUDE 0.8f
+#define DEFAULT_KICK_DURATION 20 /* ms */
+
+/* Each gun is one hand, told apart with OpenXR subaction paths: every action
+ * is created once and then queried per gun. All guns are synced and located in
+ * the same iteration, so another player costs a few more state queries rather
+ * than another xrSyncActions.
+ *
+ * Every gun gets its own uinput device. The screen rect is shared, and any gun
+ * can take the calibration shots.
+ */
+#define MAX_GUNS 2
+
+/* Light gun games reload when the gun is pointed away from the screen. Once
+ * the ray has missed the rect for --offscreen-delay, the gun is offscreen
+ * until it's been back on the rect for OFFSCREEN_EXIT_SAMPLES samples in a
+ * row, so grazing the edge of the screen doesn't flicker between the two.
+ * While a gun is offscreen:
+ *
+ * - OFFSCREEN_RELOAD sends trigger pulls as the reload key instead of fire
+ * - OFFSCREEN_PARK moves the pointer to 0,0, for games that look for that
+ */
+#define DEFAULT_OFFSCREEN_DELAY 30 /* ms */
+#define DEFAULT_RELOAD_KEY 0x111 /* BTN_RIGHT */
+#define OFFSCREEN_EXIT_SAMPLES 3
+
+typedef enum OffscreenMode
+{
+	OFFSCREEN_NONE = 0,
+	OFFSCREEN_RELOAD = 1,
+	OFFSCREEN_PARK = 2,
+	OFFSCREEN_BOTH = 3
+} OffscreenMode;
+
+static const char *offscreenModeNames[] =
+{
+	"none",
+	"reload",
+	"park",
+	"both"
+};
+
+/* A pose is only mapped if the runtime says its position and orientation are
+ * valid or, with --require-tracked, actually tracked rather than inferred.
+ * Anything else is stale or made up. While a gun's pose isn't usable, its
+ * buttons still work, and --tracking-loss says what the pointer does: hold
+ * leaves it where it was, park moves it to 0,0 like OFFSCREEN_PARK.
+ */
+typedef enum TrackingLossMode
+{
+	TRACKING_LOSS_HOLD,
+	TRACKING_LOSS_PARK
+} TrackingLossMode;
+
+/* The boolean inputs. Each one is an action, the paths it's bound to on every
+ * hand, and the key it sends on the uinput device. --buttons reads them from a
+ * file, one button per line:
+ *
+ *	# name  key       paths, relative to /user/hand/<hand>
+ *	fire    BTN_LEFT  /input/trigger/click touch:/input/trigger/value
+ *	pedal   KEY_Z     /input/a/click /input/b/click
+ *
+ * A path is for the interaction profile named in front of it, or the Index
+ * without one; see interactionProfiles. Keys are Linux key names from the
+ * table below or plain key codes. The name
+ * is the action name, so it has to be lowercase. "fire" is required and is
+ * always button 0, since calibration, kickback and offscreen reload hang off
+ * of it; "pause" is optional, holding it with fire quits.
+ *
+ * main turns this into flat arrays of actions and keys, so the sampler just
+ * walks them: one more button is one more xrGetActionStateBoolean per gun and
+ * no new code.
+ */
+#define MAX_BUTTONS 8 /* TraceRecord has a bit per button */
+#define MAX_BUTTON_PATHS 8
+#define MAX_BUTTON_PATH_LENGTH 128 /* Without the /user/hand/<hand> */
+#define BUTTON_FIRE 0
+
+typedef struct ButtonConfig
+{
+	char name[XR_MAX_ACTION_NAME_SIZE];
+	char label[XR_MAX_LOCALIZED_ACTION_NAME_SIZE]; /* For the log and the runtime's UI */
+	int key;
+	int pathCount;
+	char paths[MAX_BUTTON_PATHS][MAX_BUTTON_PATH_LENGTH];
+	int pathProfiles[MAX_BUTTON_PATHS]; /* Index into interactionProfiles */
+} ButtonConfig;
+
+/* Every profile here gets its bindings suggested in the same setup pass, so
+ * whatever controller the runtime has can be used as the gun. They all have an
+ * aim pose and a haptic output; the buttons are up to the button table.
+ */
+static const struct
+{
+	const char *name;
+	const char *path;
+} interactionProfiles[] =
+{
+	{ "index", "/interaction_profiles/valve/index_controller" },
+	{ "touch", "/interaction_profiles/oculus/touch_controller" },
+	{ "vive", "/interaction_profiles/htc/vive_controller" },
+	{ "simple", "/interaction_profiles/khr/simple_controller" }
+};
+#define PROFILE_COUNT ((int) (sizeof(interactionProfiles) / sizeof(interactionProfiles[0])))
+
+static const char *defaultButtons[] =
+{
+	"fire BTN_LEFT /input/trigger/click touch:/input/trigger/value "
+		"vive:/input/trigger/click simple:/input/select/click",
+	"pedal KEY_Z /input/a/click /input/b/click touch:/input/squeeze/value "
+		"vive:/input/squeeze/click",
+	"pause KEY_C /input/thumbstick/click touch:/input/thumbstick/click "
+		"vive:/input/trackpad/click simple:/input/menu/click"
+};
+
+#ifdef __linux__
+#define KEY_NAME(code) { #code, code }
+static const struct
+{
+	const char *name;
+	int code;
+} keyNames[] =
+{
+	KEY_NAME(BTN_LEFT), KEY_NAME(BTN_RIGHT), KEY_NAME(BTN_MIDDLE),
+	KEY_NAME(BTN_SIDE), KEY_NAME(BTN_EXTRA),
+	KEY_NAME(KEY_A), KEY_NAME(KEY_S), KEY_NAME(KEY_D), KEY_NAME(KEY_F),
+	KEY_NAME(KEY_Z), KEY_NAME(KEY_X), KEY_NAME(KEY_C), KEY_NAME(KEY_V),
+	KEY_NAME(KEY_P), KEY_NAME(KEY_R),
+	KEY_NAME(KEY_1), KEY_NAME(KEY_2), KEY_NAME(KEY_5), KEY_NAME(KEY_6),
+	KEY_NAME(KEY_ENTER), KEY_NAME(KEY_SPACE), KEY_NAME(KEY_ESC), KEY_NAME(KEY_TAB),
+	KEY_NAME(KEY_LEFTSHIFT), KEY_NAME(KEY_LEFTCTRL), KEY_NAME(KEY_LEFTALT),
+	KEY_NAME(KEY_UP), KEY_NAME(KEY_DOWN), KEY_NAME(KEY_LEFT), KEY_NAME(KEY_RIGHT)
+};
+#undef KEY_NAME
+#endif
+
+/* Returns the key code for a name or number, or -1 */
+static int parse_key(const char *name)
+{
+	char *end;
+	long code;
+
+#ifdef __linux__
+	size_t i;
+	for (i = 0; i < sizeof(keyNames) / sizeof(keyNames[0]); i += 1)
+	{
+		if (strcmp(name, keyNames[i].name) == 0)
+		{
+			return keyNames[i].code;
+		}
+	}
+#endif
+	code = strtol(name, &end, 0);
+	if (*end != '\0' || code <= 0 || code > 0x2FF) /* KEY_MAX */
+	{
+		return -1;
+	}
+	return (int) code;
+}
+
+/* Parses one button line into buttons, fire goes first. Returns 0 and prints
+ * why on failure; comments and blank lines are fine and return 1.
+ */
+static int parse_button(
+	char *line,
+	ButtonConfig *buttons,
+	int *buttonCount,
+	const char *where
+) {
+	char *save;
+	char *name = strtok_r(line, " \t\r\n", &save);
+	char *key, *path;
+	ButtonConfig *button;
+	int i;
+
+	if (name == NULL || name[0] == '#')
+	{
+		return 1;
+	}
+	for (i = 0; name[i] != '\0'; i += 1)
+	{
+		if (!islower(name[i]) && !isdigit(name[i]) && name[i] != '_' && name[i] != '-')
+		{
+			printf("%s: button names must be lowercase letters, digits, - or _\n", where);
+			return 0;
+		}
+	}
+	if (i >= XR_MAX_ACTION_NAME_SIZE || strcmp(name, "aim") == 0 || strcmp(name, "kickback") == 0)
+	{
+		printf("%s: %s can't be used as a button name\n", where, name);
+		return 0;
+	}
+
+	if (strcmp(name, "fire") == 0)
+	{
+		button = &buttons[BUTTON_FIRE];
+	}
+	else if (*buttonCount < MAX_BUTTONS)
+	{
+		button = &buttons[*buttonCount];
+	}
+	else
+	{
+		printf("%s: there can only be %d buttons\n", where, MAX_BUTTONS);
+		return 0;
+	}
+	for (i = 0; i < *buttonCount; i += 1)
+	{
+		if (strcmp(buttons[i].name, name) == 0)
+		{
+			printf("%s: %s is already a button\n", where, name);
+			return 0;
+		}
+	}
+
+	key = strtok_r(NULL, " \t\r\n", &save);
+	if (key == NULL || (button->key = parse_key(key)) < 0)
+	{
+		printf("%s: %s needs a key name or code\n", where, name);
+		return 0;
+	}
+
+	button->pathCount = 0;
+	while ((path = strtok_r(NULL, " \t\r\n", &save)) != NULL && path[0] != '#')
+	{
+		char *colon = strchr(path, ':');
+		int profile = 0;
+		if (colon != NULL)
+		{
+			*colon = '\0';
+			for (profile = 0; profile < PROFILE_COUNT; profile += 1)
+			{
+				if (strcmp(path, interactionProfiles[profile].name) == 0)
+				{
+					break;
+				}
+			}
+			if (profile == PROFILE_COUNT)
+			{
+				printf("%s: %s is not an interaction profile\n", where, path);
+				return 0;
+			}
+			path = colon + 1;
+		}
+		if (path[0] != '/' || strlen(path) >= MAX_BUTTON_PATH_LENGTH)
+		{
+			printf("%s: %s is not a path like /input/trigger/click\n", where, path);
+			return 0;
+		}
+		if (button->pathCount == MAX_BUTTON_PATHS)
+		{
+			printf("%s: %s can only have %d paths\n", where, name, MAX_BUTTON_PATHS);
+			return 0;
+		}
+		strcpy(button->paths[button->pathCount], path);
+		button->pathProfiles[button->pathCount] = profile;
+		button->pathCount += 1;
+	}
+	if (button->pathCount == 0)
+	{
+		printf("%s: %s isn't bound to anything\n", where, name);
+		return 0;
+	}
+
+	strcpy(button->name, name);
+	strcpy(button->label, name);
+	button->label[0] = toupper(button->label[0]);
+	if (button != &buttons[BUTTON_FIRE])
+	{
+		*buttonCount += 1;
+	}
+	return 1;
+}
+
+/* Slot 0 is left for fire, parse_button puts it there */
+static int load_buttons(const char *path, ButtonConfig *buttons, int *buttonCount)
+{
+	char line[1024];
+	char where[64];
+	size_t i;
+	int lineNumber = 0;
+
+	buttons[BUTTON_FIRE].name[0] = '\0';
+	*buttonCount = 1;
+	if (path == NULL)
+	{
+		for (i = 0; i < sizeof(defaultButtons) / sizeof(defaultButtons[0]); i += 1)
+		{
+			strcpy(line, defaultButtons[i]);
+			if (!parse_button(line, buttons, buttonCount, "defaults"))
+			{
+				return 0;
+			}
+		}
+		return 1;
+	}
+
+	FILE *file = fopen(path, "r");
+	if (file == NULL)
+	{
+		printf("%s could not be opened: %s\n", path, strerror(errno));
+		return 0;
+	}
+	while (fgets(line, sizeof(line), file) != NULL)
+	{
+		lineNumber += 1;
+		snprintf(where, sizeof(where), "%.48s:%d", path, lineNumber);
+		if (!parse_button(line, buttons, buttonCount, where))
+		{
+			fclose(file);
+			return 0;
+		}
+	}
+	fclose(file);
+
+	if (buttons[BUTTON_FIRE].name[0] == '\0')
+	{
+		printf("%s: there has to be a fire button\n", path);
+		return 0;
+	}
+	return 1;
+}
+
+typedef struct Options
+{
+	int pollRate;
+	XrDuration lookahead; /* Nanoseconds */
+	int upsampleRate; /* Extrapolated poses per second, 0 to disable */
+	int shotPose; /* Aim shots with the pose from when the trigger broke */
+	int screenWidth, screenHeight; /* Display mode, in pixels */
+	int region[4]; /* x, y, width, height in pixels: where the game is on screen */
+	int axisRange; /* ABS maximum, 0 to use the region's size in pixels */
+	int deadband; /* ABS changes this small or smaller aren't sent */
+	OffscreenMode offscreen;
+	XrDuration offscreenDelay; /* Nanoseconds */
+	int reloadKey; /* Linux key code */
+	int requireTracked;
+	TrackingLossMode trackingLoss;
+	const char *buttonsPath; /* --buttons, NULL for the defaults */
+	ButtonConfig buttons[MAX_BUTTONS]; /* Loaded from the above */
+	int buttonCount;
+	int pauseButton; /* -1 if there isn't one */
+	int axisMaxX, axisMaxY; /* Worked out from the above */
+	MappingMode mapping;
+	FilterParams filter;
+	int corners;
+	int screens;
+	int targets[MAX_SCREENS][4]; /* x, y, width, height in pixels: where each screen goes */
+	int targetCount; /* --target given this many times, 0 for side by side */
+	int guns;
+	char calibrationPath[4096];
+	int recalibrate;
+	int samplerCPU; /* -1 for no pinning */
+	int samplerPriority; /* SCHED_FIFO priority, 0 to disable */
+	LogLevel verbosity;
+	int pointerLogRate; /* Max pointer logs per second, 0 for every update */
+	float kickAmplitude; /* 0 to disable kickback */
+	XrDuration kickDuration; /* Nanoseconds */
+	float kickFrequency; /* Hz, XR_FREQUENCY_UNSPECIFIED for the runtime's choice */
+	int autofireRate; /* Kicks per second while fire is held, 0 for one per pull */
+	const char *tracePath; /* --record, NULL if not recording */
+	const char *replayPath; /* --replay, NULL if sampling live */
+	double replaySpeed; /* 0 for as fast as possible */
+	const char *controlPath; /* --control, NULL for no socket */
+	int latencyTest; /* Seconds to measure for, 0 for no test */
+} Options;
+
+static int parse_options(int argc, char **argv, Options *opts)
+{
+	int i;
+
+	opts->pollRate = DEFAULT_POLL_RATE;
+	opts->lookahead = 0;
+	opts->upsampleRate = 0;
+	opts->screenWidth = DEFAULT_SCREEN_WIDTH;
+	opts->screenHeight = DEFAULT_SCREEN_HEIGHT;
+	opts->region[2] = 0; /* Whole screen, see below */
+	opts->axisRange = 0;
+	opts->deadband = 0;
+	opts->offscreen = OFFSCREEN_NONE;
+	opts->offscreenDelay = DEFAULT_OFFSCREEN_DELAY * 1000000LL;
+	opts->reloadKey = DEFAULT_RELOAD_KEY;
+	opts->buttonsPath = NULL;
+	opts->requireTracked = 0;
+	opts->shotPose = 0;
+	opts->trackingLoss = TRACKING_LOSS_HOLD;
+	opts->mapping = MAPPING_RAY;
+	opts->filter.mode = FILTER_NONE;
+	opts->filter.minCutoff = DEFAULT_FILTER_MIN_CUTOFF;
+	opts->filter.beta = DEFAULT_FILTER_BETA;
+	opts->corners = 2;
+	opts->screens = 1;
+	opts->targetCount = 0;
+	opts->guns = 1;
+	calibration_default_path(opts->calibrationPath, sizeof(opts->calibrationPath));
+	opts->recalibrate = 0;
+	opts->samplerCPU = -1;
+	opts->samplerPriority = DEFAULT_SAMPLER_PRIORITY;
+	opts->verbosity = LOG_INFO;
+	opts->pointerLogRate = DEFAULT_POINTER_LOG_RATE;
+	opts->kickAmplitude = DEFAULT_KICK_AMPLITUDE;
+	opts->kickDuration = DEFAULT_KICK_DURATION * 1000000LL;
+	opts->kickFrequency = XR_FREQUENCY_UNSPECIFIED;
+	opts->autofireRate = 0;
+	opts->tracePath = NULL;
+	opts->replayPath = NULL;
+	opts->replaySpeed = 1.0;
+	opts->controlPath = NULL;
+	opts->latencyTest = 0;
+
+	for (i = 1; i < argc; i += 1)
+	{
+		#define HAS_VALUE() ((i + 1) < argc)
+		if (strcmp(argv[i], "--rate") == 0 && HAS_VALUE())
+		{
+			opts->pollRate = atoi(argv[++i]);
+			if (opts->pollRate <= 0)
+			{
+				printf("--rate must be greater than 0\n");
+				return 0;
+			}
+		}
+		else if (strcmp(argv[i], "--lookahead") == 0 && HAS_VALUE())
+		{
+			double ms = atof(argv[++i]);
+			if (ms < 0.0 || ms > 100.0)
+			{
+				printf("--lookahead must be between 0 and 100 ms\n");
+				return 0;
+			}
+			opts->lookahead = (XrDuration) (ms * 1000000.0);
+		}
+		else if (strcmp(argv[i], "--upsample") == 0 && HAS_VALUE())
+		{
+			opts->upsampleRate = atoi(argv[++i]);
+			if (opts->upsampleRate < 0)
+			{
+				printf("--upsample must be 0 or greater\n");
+				return 0;
+			}
+		}
+		else if (strcmp(argv[i], "--screen") == 0 && HAS_VALUE())
+		{
+			if (	sscanf(argv[++i], "%dx%d", &opts->screenWidth, &opts->screenHeight) != 2 ||
+				opts->screenWidth <= 0 ||
+				opts->screenHeight <= 0	)
+			{
+				printf("--screen must be <width>x<height>\n");
+				return 0;
+			}
+		}
+		else if (strcmp(argv[i], "--region") == 0 && HAS_VALUE())
+		{
+			if (	sscanf(
+					argv[++i],
+					"%d,%d,%d,%d",
+					&opts->region[0],
+					&opts->region[1],
+					&opts->region[2],
+					&opts->region[3]
+				) != 4 ||
+				opts->region[0] < 0 ||
+				opts->region[1] < 0 ||
+				opts->region[2] <= 0 ||
+				opts->region[3] <= 0	)
+			{
+				printf("--region must be <x>,<y>,<width>,<height>\n");
+				return 0;
+			}
+		}
+		else if (strcmp(argv[i], "--axis-range") == 0 && HAS_VALUE())
+		{
+			opts->axisRange = atoi(argv[++i]);
+			if (opts->axisRange < 0)
+			{
+				printf("--axis-range must be 0 or greater\n");
+				return 0;
+			}
+		}
+		else if (strcmp(argv[i], "--deadband") == 0 && HAS_VALUE())
+		{
+			opts->deadband = atoi(argv[++i]);
+			if (opts->deadband < 0)
+			{
+				printf("--deadband must be 0 or greater\n");
+				return 0;
+			}
+		}
+		else if (strcmp(argv[i], "--offscreen") == 0 && HAS_VALUE())
+		{
+			int mode;
+			i += 1;
+			for (mode = OFFSCREEN_NONE; mode <= OFFSCREEN_BOTH; mode += 1)
+			{
+				if (strcmp(argv[i], offscreenModeNames[mode]) == 0)
+				{
+					break;
+				}
+			}
+			if (mode > OFFSCREEN_BOTH)
+			{
+				printf("--offscreen must be none, reload, park or both\n");
+				return 0;
+			}
+			opts->offscreen = (OffscreenMode) mode;
+		}
+		else if (strcmp(argv[i], "--offscreen-delay") == 0 && HAS_VALUE())
+		{
+			double ms = atof(argv[++i]);
+			if (ms < 0.0 || ms > 1000.0)
+			{
+				printf("--offscreen-delay must be between 0 and 1000 ms\n");
+				return 0;
+			}
+			opts->offscreenDelay = (XrDuration) (ms * 1000000.0);
+		}
+		else if (strcmp(argv[i], "--reload-key") == 0 && HAS_VALUE())
+		{
+			opts->reloadKey = parse_key(argv[++i]);
+			if (opts->reloadKey < 0)
+			{
+				printf("--reload-key must be a Linux key name or code, i.e. BTN_RIGHT\n");
+				return 0;
+			}
+		}
+		else if (strcmp(argv[i], "--require-tracked") == 0)
+		{
+			opts->requireTracked = 1;
+		}
+		else if (strcmp(argv[i], "--shot-pose") == 0)
+		{
+			opts->shotPose = 1;
+		}
+		else if (strcmp(argv[i], "--tracking-loss") == 0 && HAS_VALUE())
+		{
+			i += 1;
+			if (strcmp(argv[i], "hold") == 0)
+			{
+				opts->trackingLoss = TRACKING_LOSS_HOLD;
+			}
+			else if (strcmp(argv[i], "park") == 0)
+			{
+				opts->trackingLoss = TRACKING_LOSS_PARK;
+			}
+			else
+			{
+				printf("--tracking-loss must be hold or park\n");
+				return 0;
+			}
+		}
+		else if (strcmp(argv[i], "--buttons") == 0 && HAS_VALUE())
+		{
+			opts->buttonsPath = argv[++i];
+		}
+		else if (strcmp(argv[i], "--mapping") == 0 && HAS_VALUE())
+		{
+			i += 1;
+			if (strcmp(argv[i], "ray") == 0)
+			{
+				opts->mapping = MAPPING_RAY;
+			}
+			else if (strcmp(argv[i], "legacy") == 0)
+			{
+				opts->mapping = MAPPING_LEGACY;
+			}
+			else
+			{
+				printf("--mapping must be ray or legacy\n");
+				return 0;
+			}
+		}
+		else if (strcmp(argv[i], "--filter") == 0 && HAS_VALUE())
+		{
+			i += 1;
+			if (strcmp(argv[i], "none") == 0)
+			{
+				opts->filter.mode = FILTER_NONE;
+			}
+			else if (strcmp(argv[i], "one-euro") == 0)
+			{
+				opts->filter.mode = FILTER_ONE_EURO;
+			}
+			else
+			{
+				printf("--filter must be none or one-euro\n");
+				return 0;
+			}
+		}
+		else if (strcmp(argv[i], "--filter-min-cutoff") == 0 && HAS_VALUE())
+		{
+			opts->filter.minCutoff = (float) atof(argv[++i]);
+			if (opts->filter.minCutoff <= 0.0f)
+			{
+				printf("--filter-min-cutoff must be greater than 0\n");
+				return 0;
+			}
+		}
+		else if (strcmp(argv[i], "--filter-beta") == 0 && HAS_VALUE())
+		{
+			opts->filter.beta = (float) atof(argv[++i]);
+			if (opts->filter.beta < 0.0f)
+			{
+				printf("--filter-beta must be 0 or greater\n");
+				return 0;
+			}
+		}
+		else if (strcmp(argv[i], "--corners") == 0 && HAS_VALUE())
+		{
+			opts->corners = atoi(argv[++i]);
+			if (opts->corners < 2 || opts->corners > 4)
+			{
+				printf("--corners must be 2, 3 or 4\n");
+				return 0;
+			}
+		}
+		else if (strcmp(argv[i], "--screens") == 0 && HAS_VALUE())
+		{
+			opts->screens = atoi(argv[++i]);
+			if (opts->screens < 1 || opts->screens > MAX_SCREENS)
+			{
+				printf("--screens must be between 1 and %d\n", MAX_SCREENS);
+				return 0;
+			}
+		}
+		else if (strcmp(argv[i], "--target") == 0 && HAS_VALUE())
+		{
+			int *target;
+			if (opts->targetCount == MAX_SCREENS)
+			{
+				printf("--target can only be given %d times\n", MAX_SCREENS);
+				return 0;
+			}
+			target = opts->targets[opts->targetCount];
+			if (	sscanf(
+					argv[++i],
+					"%d,%d,%d,%d",
+					&target[0],
+					&target[1],
+					&target[2],
+					&target[3]
+				) != 4 ||
+				target[0] < 0 ||
+				target[1] < 0 ||
+				target[2] <= 0 ||
+				target[3] <= 0	)
+			{
+				printf("--target must be <x>,<y>,<width>,<height>\n");
+				return 0;
+			}
+			opts->targetCount += 1;
+		}
+		else if (strcmp(argv[i], "--guns") == 0 && HAS_VALUE())
+		{
+			opts->guns = atoi(argv[++i]);
+			if (opts->guns < 1 || opts->guns > MAX_GUNS)
+			{
+				printf("--guns must be between 1 and %d\n", MAX_GUNS);
+				return 0;
+			}
+		}
+		else if (strcmp(argv[i], "--calibration") == 0 && HAS_VALUE())
+		{
+			snprintf(opts->calibrationPath, sizeof(opts->calibrationPath), "%s", argv[++i]);
+		}
+		else if (strcmp(argv[i], "--recalibrate") == 0)
+		{
+			opts->recalibrate = 1;
+		}
+		else if (strcmp(argv[i], "--cpu") == 0 && HAS_VALUE())
+		{
+			opts->samplerCPU = atoi(argv[++i]);
+			if (opts->samplerCPU < 0 || opts->samplerCPU >= CPU_SETSIZE)
+			{
+				printf("--cpu must be a valid CPU index\n");
+				return 0;
+			}
+		}
+		else if (strcmp(argv[i], "--priority") == 0 && HAS_VALUE())
+		{
+			opts->samplerPriority = atoi(argv[++i]);
+			if (opts->samplerPriority < 0 || opts->samplerPriority > 99)
+			{
+				printf("--priority must be between 0 and 99\n");
+				return 0;
+			}
+		}
+		else if (strcmp(argv[i], "--verbosity") == 0 && HAS_VALUE())
+		{
+			int level;
+			i += 1;
+			for (level = LOG_ERROR; level <= LOG_DEBUG; level += 1)
+			{
+				if (strcmp(argv[i], logLevelNames[level]) == 0)
+				{
+					break;
+				}
+			}
+			if (level > LOG_DEBUG)
+			{
+				printf("--verbosity must be error, warning, info or debug\n");
+				return 0;
+			}
+			opts->verbosity = (LogLevel) level;
+		}
+		else if (strcmp(argv[i], "--pointer-log-rate") == 0 && HAS_VALUE())
+		{
+			opts->pointerLogRate = atoi(argv[++i]);
+			if (opts->pointerLogRate < 0)
+			{
+				printf("--pointer-log-rate must be 0 or greater\n");
+				return 0;
+			}
+		}
+		else if (strcmp(argv[i], "--kick-amplitude") == 0 && HAS_VALUE())
+		{
+			opts->kickAmplitude = (float) atof(argv[++i]);
+			if (opts->kickAmplitude < 0.0f || opts->kickAmplitude > 1.0f)
+			{
+				printf("--kick-amplitude must be between 0 and 1\n");
+				return 0;
+			}
+		}
+		else if (strcmp(argv[i], "--kick-duration") == 0 && HAS_VALUE())
+		{
+			double ms = atof(argv[++i]);
+			if (ms <= 0.0 || ms > 1000.0)
+			{
+				printf("--kick-duration must be between 0 and 1000 ms\n");
+				return 0;
+			}
+			opts->kickDuration = (XrDuration) (ms * 1000000.0);
+		}
+		else if (strcmp(argv[i], "--kick-frequency") == 0 && HAS_VALUE())
+		{
+			opts->kickFrequency = (float) atof(argv[++i]);
+			if (opts->kickFrequency < 0.0f)
+			{
+				printf("--kick-frequency must be 0 or greater\n");
+				return 0;
+			}
+		}
+		else if (strcmp(argv[i], "--autofire") == 0 && HAS_VALUE())
+		{
+			opts->autofireRate = atoi(argv[++i]);
+			if (opts->autofireRate < 0 || opts->autofireRate > 100)
+			{
+				printf("--autofire must be between 0 and 100\n");
+				return 0;
+			}
+		}
+		else if (strcmp(argv[i], "--record") == 0 && HAS_VALUE())
+		{
+			opts->tracePath = argv[++i];
+		}
+		else if (strcmp(argv[i], "--replay") == 0 && HAS_VALUE())
+		{
+			opts->replayPath = argv[++i];
+		}
+		else if (strcmp(argv[i], "--replay-speed") == 0 && HAS_VALUE())
+		{
+			opts->replaySpeed = atof(argv[++i]);
+			if (opts->replaySpeed < 0.0)
+			{
+				printf("--replay-speed must be 0 or greater\n");
+				return 0;
+			}
+		}
+		else if (strcmp(argv[i], "--control") == 0 && HAS_VALUE())
+		{
+			opts->controlPath = argv[++i];
+		}
+		else if (strcmp(argv[i], "--latency-test") == 0 && HAS_VALUE())
+		{
+			opts->latencyTest = atoi(argv[++i]);
+			if (opts->latencyTest <= 0)
+			{
+				printf("--latency-test must be greater than 0\n");
+				return 0;
+			}
+		}
+		else
+		{
+			printf(
+				"Usage: %s [options]\n"
+				"  --rate <hz>        Target polling rate (default %d)\n"
+				"  --lookahead <ms>   Predict the aim pose this far ahead (default 0)\n"
+				"  --upsample <hz>    Extrapolate stale poses up to this rate, 0 for off (default 0)\n"
+				"  --shot-pose        Aim shots where the gun was when the trigger broke\n"
+				"  --screen <w>x<h>   Display mode (default %dx%d)\n"
+				"  --region <x>,<y>,<w>,<h>\n"
+				"                     Part of the screen the game uses (default all of it)\n"
+				"  --axis-range <n>   ABS axis maximum, 0 for the region in pixels (default 0)\n"
+				"  --deadband <n>     Ignore ABS changes of n units or less (default 0)\n"
+				"  --offscreen <mode> Offscreen action, none, reload, park or both (default none)\n"
+				"  --offscreen-delay <ms>\n"
+				"                     How long the ray has to miss to go offscreen (default %d)\n"
+				"  --reload-key <key> Key for offscreen reload (default BTN_RIGHT)\n"
+				"  --buttons <file>   Read the buttons, their bindings and keys from a file\n"
+				"  --require-tracked  Ignore poses the runtime is only inferring\n"
+				"  --tracking-loss <mode>\n"
+				"                     Pointer while tracking is lost, hold or park (default hold)\n"
+				"  --mapping <mode>   Pointer math, ray or legacy (default ray)\n"
+				"  --filter <mode>    Pointer smoothing, none or one-euro (default none)\n"
+				"  --filter-min-cutoff <hz>\n"
+				"                     One Euro cutoff at rest (default %.1f)\n"
+				"  --filter-beta <x>  One Euro speed coefficient (default %.1f)\n"
+				"  --corners <n>      Screen corners to calibrate, 2-4 (default 2)\n"
+				"  --screens <n>      Screens (or other hit regions) to calibrate (max %d, default 1)\n"
+				"  --target <x>,<y>,<w>,<h>\n"
+				"                     Where the next screen is on --screen, once per screen\n"
+				"                     (default side by side)\n"
+				"  --guns <n>         Number of guns, right hand first (max %d, default 1)\n"
+				"  --calibration <f>  Calibration cache file (default %s)\n"
+				"  --recalibrate      Ignore the calibration cache\n"
+				"  --cpu <n>          Pin the sampler thread to this CPU\n"
+				"  --priority <n>     SCHED_FIFO priority of the sampler, 0 for none (default %d)\n"
+				"  --verbosity <lvl>  error, warning, info or debug (default info)\n"
+				"  --pointer-log-rate <hz>\n"
+				"                     Max pointer logs per second at debug, 0 for all (default %d)\n"
+				"  --kick-amplitude <x>\n"
+				"                     Kickback strength, 0-1, 0 to disable (default %.1f)\n"
+				"  --kick-duration <ms>\n"
+				"                     Kickback length (default %d)\n"
+				"  --kick-frequency <hz>\n"
+				"                     Kickback frequency, 0 for the runtime's default (default 0)\n"
+				"  --autofire <hz>    Repeat the kickback while fire is held (default 0, off)\n"
+				"  --record <file>    Record a pose trace\n"
+				"  --replay <file>    Replay a pose trace instead of using OpenXR\n"
+				"  --replay-speed <x> Replay speed multiplier, 0 for unthrottled (default 1)\n"
+				"  --control <path>   Unix socket for stats and live tuning\n"
+				"  --latency-test <s> Read our own evdev nodes back for this long, then\n"
+				"                     report the latency and exit\n",
+				argv[0],
+				DEFAULT_POLL_RATE,
+				DEFAULT_SCREEN_WIDTH,
+				DEFAULT_SCREEN_HEIGHT,
+				DEFAULT_OFFSCREEN_DELAY,
+				DEFAULT_FILTER_MIN_CUTOFF,
+				DEFAULT_FILTER_BETA,
+				MAX_SCREENS,
+				MAX_GUNS,
+				opts->calibrationPath,
+				DEFAULT_SAMPLER_PRIORITY,
+				DEFAULT_POINTER_LOG_RATE,
+				DEFAULT_KICK_AMPLITUDE,
+				DEFAULT_KICK_DURATION
+			);
+			return 0;
+		}
+		#undef HAS_VALUE
+	}
+	if (opts->tracePath != NULL && opts->replayPath != NULL)
+	{
+		printf("--record and --replay can't be used together\n");
+		return 0;
+	}
+	if (opts->upsampleRate > opts->pollRate)
+	{
+		printf("--upsample can't be faster than --rate\n");
+		return 0;
+	}
+
+	if (opts->region[2] == 0)
+	{
+		opts->region[0] = 0;
+		opts->region[1] = 0;
+		opts->region[2] = opts->screenWidth;
+		opts->region[3] = opts->screenHeight;
+	}
+	else if (	(opts->region[0] + opts->region[2]) > opts->screenWidth ||
+			(opts->region[1] + opts->region[3]) > opts->screenHeight	)
+	{
+		printf("--region must fit on the --screen\n");
+		return 0;
+	}
+
+	if (opts->targetCount == 0)
+	{
+		for (i = 0; i < opts->screens; i += 1)
+		{
+			opts->targets[i][0] = (opts->screenWidth * i) / opts->screens;
+			opts->targets[i][1] = 0;
+			opts->targets[i][2] = ((opts->screenWidth * (i + 1)) / opts->screens) - opts->targets[i][0];
+			opts->targets[i][3] = opts->screenHeight;
+		}
+	}
+	else if (opts->targetCount != opts->screens)
+	{
+		printf("--target has to be given once per screen\n");
+		return 0;
+	}
+	for (i = 0; i < opts->screens; i += 1)
+	{
+		if (	(opts->targets[i][0] + opts->targets[i][2]) > opts->screenWidth ||
+			(opts->targets[i][1] + opts->targets[i][3]) > opts->screenHeight	)
+		{
+			printf("--target must fit on the --screen\n");
+			return 0;
+		}
+	}
+
+	opts->axisMaxX = (opts->axisRange > 0) ? opts->axisRange : opts->region[2];
+	opts->axisMaxY = (opts->axisRange > 0) ? opts->axisRange : opts->region[3];
+
+	if (!load_buttons(opts->buttonsPath, opts->buttons, &opts->buttonCount))
+	{
+		return 0;
+	}
+	opts->pauseButton = -1;
+	for (i = 0; i < opts->buttonCount; i += 1)
+	{
+		if (strcmp(opts->buttons[i].name, "pause") == 0)
+		{
+			opts->pauseButton = i;
+		}
+	}
+	return 1;
+}
+
+/* Everything the sampler needs from one iteration, wherever it came from */
+typedef struct Sample
+{
+	int gun;
+	uint64_t time; /* CLOCK_MONOTONIC, in nanoseconds */
+	uint64_t poseTime; /* Same as time live, the recorded time on replay */
+	XrSpaceLocationFlags locationFlags;
+	XrPosef pose;
+	XrBool32 buttons[MAX_BUTTONS]; /* currentState */
+	XrBool32 changed[MAX_BUTTONS]; /* changedSinceLastSync */
+	uint64_t changeTimes[MAX_BUTTONS]; /* lastChangeTime as CLOCK_MONOTONIC, 0 if unknown */
+
+	/* Set by sampler_map_batch, so sampler_process can skip the mapping */
+	int mapped;
+	int hit;
+	float pointerX, pointerY;
+} Sample;
+
+/* Pose traces.
+ *
+ * --record writes every sample taken while the session is focused to a file:
+ * a TraceHeader followed by fixed-size TraceRecords. --replay maps that file
+ * and feeds it back through the exact same code as live samples, with no
+ * OpenXR runtime needed, so the pipeline can be profiled and regression tested
+ * anywhere.
+ *
+ * The header holds the calibration that was active when recording started, so
+ * that traces recorded with a cached calibration still replay correctly. If the
+ * recording started uncalibrated, the calibration shots are in the trace.
+ *
+ * With more than one gun, each iteration writes one record per gun. Replaying
+ * with fewer --guns than were recorded just skips the extra guns.
+ *
+ * If the service thread ever falls far enough behind that records are lost,
+ * the header says how many, and a replay warns that it won't be the same run.
+ */
+#define TRACE_MAGIC 0x5458474C /* 'LGXT' */
+#define TRACE_VERSION 3 /* 2: More than one screen, 3: Dropped records */
+
+typedef struct TraceHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t headerSize;
+	uint32_t recordSize;
+	uint32_t calibrated;
+	uint32_t cornerCount;
+	uint32_t screenCount;
+	uint32_t dropped; /* Records the recorder couldn't keep up with, see service_trace */
+	XrVector3f corners[MAX_SCREENS][4];
+} TraceHeader;
+
+typedef struct TraceRecord
+{
+	uint64_t time;
+	uint64_t locationFlags;
+	XrPosef pose;
+	uint8_t buttons; /* Bit per button, currentState */
+	uint8_t changed; /* Bit per button, changedSinceLastSync */
+	uint8_t gun;
+	uint8_t padding;
+} TraceRecord;
+
+typedef struct Trace
+{
+	const TraceHeader *header;
+	const TraceRecord *records;
+	size_t count;
+	size_t mappedSize;
+} Trace;
+
+static void trace_record_from_sample(TraceRecord *record, const Sample *sample)
+{
+	int i;
+
+	record->time = sample->time;
+	record->locationFlags = sample->locationFlags;
+	record->pose = sample->pose;
+	record->buttons = 0;
+	record->changed = 0;
+	for (i = 0; i < MAX_BUTTONS; i += 1)
+	{
+		record->buttons |= (sample->buttons[i] ? 1 : 0) << i;
+		record->changed |= (sample->changed[i] ? 1 : 0) << i;
+	}
+	record->gun = sample->gun;
+	record->padding = 0;
+}
+
+static void trace_record_to_sample(const TraceRecord *record, Sample *sample)
+{
+	int i;
+
+	sample->gun = record->gun;
+	sample->time = record->time;
+	sample->poseTime = record->time;
+	sample->locationFlags = record->locationFlags;
+	sample->pose = record->pose;
+	sample->mapped = 0;
+	for (i = 0; i < MAX_BUTTONS; i += 1)
+	{
+		sample->buttons[i] = (record->buttons >> i) & 1;
+		sample->changed[i] = (record->changed >> i) & 1;
+		sample->changeTimes[i] = 0; /* Not recorded, evdev's own time will do */
+	}
+}
+
+static FILE* trace_create(const char *path, const Screens *screens, int calibrated)
+{
+	TraceHeader header;
+	FILE *file;
+	int i;
+
+	file = fopen(path, "wb");
+	if (file == NULL)
+	{
+		return NULL;
+	}
+
+	memset(&header, '\0', sizeof(header));
+	header.magic = TRACE_MAGIC;
+	header.version = TRACE_VERSION;
+	header.headerSize = sizeof(TraceHeader);
+	header.recordSize = sizeof(TraceRecord);
+	header.calibrated = calibrated;
+	header.cornerCount = screens->rects[0].cornerCount;
+	header.screenCount = screens->count;
+	for (i = 0; calibrated && i < screens->count; i += 1)
+	{
+		memcpy(header.corners[i], screens->rects[i].corners, sizeof(header.corners[i]));
+	}
+	if (fwrite(&header, sizeof(header), 1, file) != 1)
+	{
+		fclose(file);
+		return NULL;
+	}
+	return file;
+}
+
+/* Maps a trace for reading, returns 0 and prints why on failure */
+static int trace_open(const char *path, Trace *trace)
+{
+	struct stat st;
+	void *data;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+	{
+		printf("%s could not be opened: %s\n", path, strerror(errno));
+		return 0;
+	}
+	if (fstat(fd, &st) == -1 || st.st_size < (off_t) sizeof(TraceHeader))
+	{
+		printf("%s is not a trace\n", path);
+		close(fd);
+		return 0;
+	}
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+	{
+		printf("%s could not be mapped: %s\n", path, strerror(errno));
+		return 0;
+	}
+
+	trace->header = (const TraceHeader*) data;
+	if (	trace->header->magic != TRACE_MAGIC ||
+		trace->header->version != TRACE_VERSION ||
+		trace->header->headerSize != sizeof(TraceHeader) ||
+		trace->header->recordSize != sizeof(TraceRecord) ||
+		trace->header->cornerCount < 2 ||
+		trace->header->cornerCount > 4 ||
+		trace->header->screenCount < 1 ||
+		trace->header->screenCount > MAX_SCREENS	)
+	{
+		printf("%s is not a compatible trace\n", path);
+		munmap(data, st.st_size);
+		return 0;
+	}
+
+	if (trace->header->dropped > 0)
+	{
+		printf(
+			"%s is missing %u samples that couldn't be recorded in time, the replay won't match the recording\n",
+			path,
+			trace->header->dropped
+		);
+	}
+
+	/* A recording that was cut off leaves a partial record, just drop it */
+	trace->records = (const TraceRecord*) (trace->header + 1);
+	trace->count = (st.st_size - sizeof(TraceHeader)) / sizeof(TraceRecord);
+	trace->mappedSize = st.st_size;
+
+	/* We stream through it exactly once */
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+	return 1;
+}
+
+static void trace_close(Trace *trace)
+{
+	munmap((void*) trace->header, trace->mappedSize);
+}
+
+/* Threading model:
+ *
+ * The sampler thread owns the hot path: xrSyncActions, pose/button sampling,
+ * pointer mapping and uinput writes. It runs at SCHED_FIFO priority (when we're
+ * allowed to) and can be pinned to a CPU, so that it doesn't get preempted by
+ * the rest of the process or the host.
+ *
+ * The main thread becomes the service thread once the session has begun. It
+ * polls OpenXR events and does everything that's allowed to be slow, like
+ * printing and file I/O.
+ *
+ * The sampler never blocks on the service thread; it reports what happened by
+ * pushing Messages into a single-producer/single-consumer ring. If the ring is
+ * full the message is dropped and counted, rather than stalling a sample.
+ * --record has a much bigger ring of its own, see TraceRing.
+ *
+ * Haptics are the one latency sensitive job on the service thread, so that a
+ * slow xrApplyHapticFeedback can't hold up the next sample. The sampler stores
+ * the kick in a per-gun slot (a kick that hasn't been applied yet just gets
+ * replaced, so they coalesce) and posts a semaphore to wake the service thread
+ * right away.
+ */
+#define RING_SIZE 1024 /* Must be a power of two */
+#define CACHE_LINE_SIZE 64
+
+typedef enum MessageType
+{
+	MESSAGE_PROMPT,
+	MESSAGE_CORNER,
+	MESSAGE_CALIBRATED,
+	MESSAGE_CALIBRATION_FAILED,
+	MESSAGE_BUTTON,
+	MESSAGE_POINTER,
+	MESSAGE_OFFSCREEN,
+	MESSAGE_TRACKING,
+	MESSAGE_CORNER_UNTRACKED,
+	MESSAGE_XR_ERROR,
+	MESSAGE_WRITE_ERROR,
+	MESSAGE_SESSION_LOST,
+	MESSAGE_AFFINITY_FAILED,
+	MESSAGE_PRIORITY_FAILED,
+	MESSAGE_REPLAY_DONE
+} MessageType;
+
+static const LogLevel messageLevels[] =
+{
+	LOG_INFO, /* MESSAGE_PROMPT */
+	LOG_INFO, /* MESSAGE_CORNER */
+	LOG_INFO, /* MESSAGE_CALIBRATED, pushed directly, the service thread saves the cache on it */
+	LOG_WARNING, /* MESSAGE_CALIBRATION_FAILED */
+	LOG_INFO, /* MESSAGE_BUTTON */
+	LOG_DEBUG, /* MESSAGE_POINTER */
+	LOG_INFO, /* MESSAGE_OFFSCREEN */
+	LOG_WARNING, /* MESSAGE_TRACKING */
+	LOG_WARNING, /* MESSAGE_CORNER_UNTRACKED */
+	LOG_ERROR, /* MESSAGE_XR_ERROR */
+	LOG_ERROR, /* MESSAGE_WRITE_ERROR */
+	LOG_WARNING, /* MESSAGE_SESSION_LOST */
+	LOG_WARNING, /* MESSAGE_AFFINITY_FAILED */
+	LOG_WARNING, /* MESSAGE_PRIORITY_FAILED */
+	LOG_INFO /* MESSAGE_REPLAY_DONE, pushed directly, the service thread reports the replay on it */
+};
+
+typedef struct Message
+{
+	MessageType type;
+	union
+	{
+		struct
+		{
+			int screen;
+			Corner corner;
+		} prompt;
+		struct
+		{
+			int screen;
+			Corner corner;
+			XrVector3f position;
+		} recorded;
+		struct
+		{
+			int gun;
+			const char *name;
+			int pressed;
+		} button;
+		struct
+		{
+			int gun;
+			float x, y;
+		} pointer;
+		struct
+		{
+			int gun;
+			int offscreen;
+		} offscreen;
+		struct
+		{
+			int gun;
+			int lost;
+		} tracking;
+		struct
+		{
+			int gun;
+			int error;
+		} write;
+		struct
+		{
+			const char *function;
+			XrResult result;
+		} xr;
+		struct
+		{
+			size_t samples;
+			uint64_t elapsed;
+		} replay;
+		int error;
+	};
+} Message;
+
+typedef struct Ring
+{
+	Message messages[RING_SIZE];
+	_Alignas(CACHE_LINE_SIZE) atomic_uint head; /* Written by the producer */
+	_Alignas(CACHE_LINE_SIZE) atomic_uint tail; /* Written by the consumer */
+	atomic_uint dropped;
+} Ring;
+
+static void ring_init(Ring *ring)
+{
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->dropped, 0);
+}
+
+static int ring_push(Ring *ring, const Message *message)
+{
+	const unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	const unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	if ((head - tail) == RING_SIZE)
+	{
+		atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+		return 0;
+	}
+	ring->messages[head & (RING_SIZE - 1)] = *message;
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	return 1;
+}
+
+static int ring_pop(Ring *ring, Message *message)
+{
+	const unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	const unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+	if (tail == head)
+	{
+		return 0;
+	}
+	*message = ring->messages[tail & (RING_SIZE - 1)];
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+	return 1;
+}
+
+/* Same as Ring, just for trace records. A trace is only reproducible if it
+ * has every sample, so records don't compete with log traffic for room, and
+ * there's enough of it for a few seconds of service thread stalls at 1kHz
+ * with every gun. Anything dropped anyway is written into the trace header.
+ */
+#define TRACE_RING_SIZE 8192 /* Must be a power of two */
+
+typedef struct TraceRing
+{
+	TraceRecord records[TRACE_RING_SIZE];
+	_Alignas(CACHE_LINE_SIZE) atomic_uint head; /* Written by the producer */
+	_Alignas(CACHE_LINE_SIZE) atomic_uint tail; /* Written by the consumer */
+	atomic_uint dropped;
+} TraceRing;
+
+static void trace_ring_init(TraceRing *ring)
+{
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->dropped, 0);
+}
+
+static int trace_ring_push(TraceRing *ring, const TraceRecord *record)
+{
+	const unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	const unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	if ((head - tail) == TRACE_RING_SIZE)
+	{
+		atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+		return 0;
+	}
+	ring->records[head & (TRACE_RING_SIZE - 1)] = *record;
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	return 1;
+}
+
+static int trace_ring_pop(TraceRing *ring, TraceRecord *record)
+{
+	const unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	const unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+	if (tail == head)
+	{
+		return 0;
+	}
+	*record = ring->records[tail & (TRACE_RING_SIZE - 1)];
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+	return 1;
+}
+
+/* The sampler only ever needs XrTime for "now", and runtimes keep XrTime a
+ * fixed offset from CLOCK_MONOTONIC (most just use it directly). So the offset
+ * is measured with xrConvertTimespecTimeToTimeKHR on the first conversion and
+ * again every TIME_BASE_CHECK_NS in case the runtime's clock drifts; every
+ * conversion in between is one add, with no call into the runtime.
+ */
+#define TIME_BASE_CHECK_NS 1000000000ULL /* 1s */
+
+typedef struct TimeBase
+{
+	XrInstance instance;
+	PFN_xrConvertTimespecTimeToTimeKHR convert;
+	int64_t offset; /* XrTime - CLOCK_MONOTONIC */
+	uint64_t nextCheck;
+} TimeBase;
+
+static void time_base_init(
+	TimeBase *base,
+	XrInstance instance,
+	PFN_xrConvertTimespecTimeToTimeKHR convert
+) {
+	base->instance = instance;
+	base->convert = convert;
+	base->offset = 0;
+	base->nextCheck = 0;
+}
+
+/* monotonic is in nanoseconds, i.e. from now_ns */
+static XrResult time_base_to_xr(TimeBase *base, uint64_t monotonic, XrTime *time)
+{
+	if (monotonic >= base->nextCheck)
+	{
+		struct timespec ts;
+		XrTime measured;
+		XrResult res;
+
+		ts.tv_sec = monotonic / NS_PER_SEC;
+		ts.tv_nsec = monotonic % NS_PER_SEC;
+		res = base->convert(base->instance, &ts, &measured);
+		if (res != XR_SUCCESS)
+		{
+			return res;
+		}
+		base->offset = (int64_t) measured - (int64_t) monotonic;
+		base->nextCheck = monotonic + TIME_BASE_CHECK_NS;
+	}
+	*time = (XrTime) ((int64_t) monotonic + base->offset);
+	return XR_SUCCESS;
+}
+
+/* The other way, for times the runtime hands back. now is only there to keep
+ * the offset fresh. Sets *monotonic to 0 for a time from before CLOCK_MONOTONIC
+ * started, and clamps times from the future to now.
+ */
+static XrResult time_base_from_xr(
+	TimeBase *base,
+	uint64_t now,
+	XrTime time,
+	uint64_t *monotonic
+) {
+	XrTime unused;
+	int64_t result;
+
+	const XrResult res = time_base_to_xr(base, now, &unused);
+	if (res != XR_SUCCESS)
+	{
+		return res;
+	}
+	result = (int64_t) time - base->offset;
+	if (result <= 0)
+	{
+		*monotonic = 0;
+	}
+	else if ((uint64_t) result > now)
+	{
+		*monotonic = now;
+	}
+	else
+	{
+		*monotonic = (uint64_t) result;
+	}
+	return XR_SUCCESS;
+}
+
+/* Why the sampler stopped. Whoever stops it first gets to say why */
+typedef enum SessionEnd
+{
+	SESSION_END_NONE,
+	SESSION_END_QUIT, /* Fire + pause, or the replay finished */
+	SESSION_END_ERROR, /* Something failed, see returnCode */
+	SESSION_END_STOPPING, /* The runtime wants the session ended, may come back */
+	SESSION_END_LOST, /* The session is gone, make a new one */
+	SESSION_END_EXIT /* The runtime or instance is going away */
+} SessionEnd;
+
+/* Per-gun sampler state */
+typedef struct Gun
+{
+	uint64_t nextKick; /* Pose time of the next autofire kick */
+	XrPosef freshPose; /* Last pose that came from the tracker */
+	PoseVelocity freshVelocity;
+	uint64_t freshTime; /* When freshPose showed up */
+	XrPosef upsampledPose; /* Last pose handed on while freshPose is stale */
+	uint64_t nextUpsample;
+	float rawX, rawY; /* Before filtering */
+	PointerFilter filter;
+	float mouseX, mouseY;
+	int axisX, axisY; /* Last ABS values sent, -1 to force a resend */
+	int offscreen;
+	int trackingLost;
+	uint64_t lastHit; /* Pose time the ray was last on a rect */
+	int screen; /* The rect it was on, screens_hit tries it first */
+	int hitStreak; /* Hits in a row while offscreen */
+	int fireKey; /* What the trigger was pressed as, so it's released as the same */
+	uint64_t nextPointerLog;
+#ifdef __linux__
+	EventBatch batch;
+	int lastWriteError;
+#endif
+} Gun;
+
+/* The options that --control can change while running. The service thread
+ * stores them and the sampler loads them where it uses them, both relaxed, so
+ * a change shows up within an iteration or two.
+ */
+typedef struct Tunables
+{
+	_Atomic int64_t lookahead; /* Nanoseconds */
+	atomic_int deadband;
+	atomic_int verbosity; /* LogLevel */
+	_Atomic float filterMinCutoff; /* Hz */
+	_Atomic float filterBeta;
+} Tunables;
+
+#define TUNABLE(sampler, name) \
+	atomic_load_explicit(&(sampler)->tunables.name, memory_order_relaxed)
+
+typedef struct Sampler
+{
+	/* Shared with the service thread */
+	atomic_int run;
+	atomic_int end; /* SessionEnd */
+	int returnCode; /* Only read after the sampler is joined */
+	Ring ring;
+	TraceRing traceRing; /* Only used with --record */
+	Stats stats;
+	sem_t wake; /* Posted when the service thread has work to do right away */
+	sem_t resume; /* Posted by the service thread when the session state changes */
+	_Atomic uint64_t kicks[MAX_GUNS]; /* Sample time of the pending kick, 0 for none */
+	Tunables tunables;
+
+	/* Set up by main before the thread starts, read-only afterward */
+	const Options *opts;
+	XrInstance instance;
+	XrSession session;
+	XrActionSet actionSet;
+	XrAction buttonActions[MAX_BUTTONS];
+	int buttonKeys[MAX_BUTTONS];
+	XrAction kickback; /* XR_NULL_HANDLE when there's no session to kick */
+	XrPath handPaths[MAX_GUNS];
+	XrSpace baseSpace;
+	XrSpace aimSpaces[MAX_GUNS];
+	PFN_xrConvertTimespecTimeToTimeKHR pxrConvertTimespecTimeToTimeKHR;
+#ifdef XR_KHR_locate_spaces
+	PFN_xrLocateSpacesKHR pxrLocateSpacesKHR; /* NULL without XR_KHR_locate_spaces */
+#endif
+	int fds[MAX_GUNS];
+	const Trace *replay; /* NULL when sampling live */
+
+	/* Owned by the sampler until MESSAGE_CALIBRATED is pushed; after that
+	 * it's never written again, so the service thread can read it.
+	 */
+	Screens screens;
+	enum
+	{
+		RECORDING,
+		PLAYING
+	} state;
+
+	/* Only ever touched by the sampler thread */
+	int calibrationStep;
+	uint64_t pointerLogPeriod;
+	uint64_t autofirePeriod;
+	uint64_t upsamplePeriod;
+	XrSpaceLocationFlags trackingFlags; /* All of these have to be set to map a pose */
+	float axisScale[2], axisOffset[2]; /* Screen -> region -> axis */
+	Gun guns[MAX_GUNS];
+
+	/* Only ever touched by the service thread */
+	XrResult lastKickResult;
+	uint32_t traceDropped; /* So far, as written in the trace header */
+#ifdef __linux__
+	EvdevReader evdev[MAX_GUNS];
+	uint64_t evdevDeadline;
+	uint64_t latencyTestStart; /* First measurement, 0 if there's none yet */
+#endif
+} Sampler;
+
+/* Everything shared, and the handles left empty, for main to fill in */
+static void sampler_init(Sampler *sampler, const Options *opts)
+{
+	int i;
+
+	atomic_init(&sampler->run, 1);
+	atomic_init(&sampler->end, SESSION_END_NONE);
+	sampler->returnCode = 0;
+	ring_init(&sampler->ring);
+	trace_ring_init(&sampler->traceRing);
+	stats_init(&sampler->stats);
+	sem_init(&sampler->wake, 0, 0);
+	sem_init(&sampler->resume, 0, 0);
+	for (i = 0; i < MAX_GUNS; i += 1)
+	{
+		atomic_init(&sampler->kicks[i], 0);
+	}
+	atomic_init(&sampler->tunables.lookahead, opts->lookahead);
+	atomic_init(&sampler->tunables.deadband, opts->deadband);
+	atomic_init(&sampler->tunables.verbosity, opts->verbosity);
+	atomic_init(&sampler->tunables.filterMinCutoff, opts->filter.minCutoff);
+	atomic_init(&sampler->tunables.filterBeta, opts->filter.beta);
+	for (i = 0; i < opts->buttonCount; i += 1)
+	{
+		sampler->buttonKeys[i] = opts->buttons[i].key;
+	}
+	sampler->opts = opts;
+	sampler->screens.count = opts->screens;
+	for (i = 0; i < opts->screens; i += 1)
+	{
+		sampler->screens.rects[i].cornerCount = opts->corners;
+		sampler->screens.targets[i][0] = opts->targets[i][0] / (float) opts->screenWidth;
+		sampler->screens.targets[i][1] = opts->targets[i][1] / (float) opts->screenHeight;
+		sampler->screens.targets[i][2] = opts->targets[i][2] / (float) opts->screenWidth;
+		sampler->screens.targets[i][3] = opts->targets[i][3] / (float) opts->screenHeight;
+	}
+	sampler->instance = XR_NULL_HANDLE;
+	sampler->session = XR_NULL_HANDLE;
+	sampler->kickback = XR_NULL_HANDLE;
+#ifdef XR_KHR_locate_spaces
+	sampler->pxrLocateSpacesKHR = NULL;
+#endif
+	sampler->replay = NULL;
+	sampler->lastKickResult = XR_SUCCESS;
+	sampler->traceDropped = 0;
+#ifdef __linux__
+	for (i = 0; i < MAX_GUNS; i += 1)
+	{
+		sampler->evdev[i].fd = -1;
+		sampler->evdev[i].failed = (opts->latencyTest == 0);
+		sampler->evdev[i].stamped = 0;
+		sampler->evdev[i].dropped = 0;
+	}
+	sampler->evdevDeadline = 0;
+	sampler->latencyTestStart = 0;
+#endif
+}
+
+static void sampler_destroy(Sampler *sampler)
+{
+#ifdef __linux__
+	int i;
+
+	for (i = 0; i < MAX_GUNS; i += 1)
+	{
+		if (sampler->evdev[i].fd != -1)
+		{
+			close(sampler->evdev[i].fd);
+		}
+	}
+#endif
+	sem_destroy(&sampler->wake);
+	sem_destroy(&sampler->resume);
+}
+
+/* Safe to call from either thread */
+static void sampler_stop(Sampler *sampler, SessionEnd end)
+{
+	int none = SESSION_END_NONE;
+	atomic_compare_exchange_strong(&sampler->end, &none, end);
+	atomic_store(&sampler->run, 0);
+}
+
+static void sampler_push(Sampler *sampler, const Message *message)
+{
+	const LogLevel verbosity = (LogLevel) TUNABLE(sampler, verbosity);
+	if (messageLevels[message->type] <= verbosity)
+	{
+		ring_push(&sampler->ring, message);
+	}
+}
+
+static void sampler_message(Sampler *sampler, MessageType type)
+{
+	Message message;
+	message.type = type;
+	sampler_push(sampler, &message);
+}
+
+static void sampler_button(Sampler *sampler, int gun, const char *name, int pressed)
+{
+	Message message;
+	message.type = MESSAGE_BUTTON;
+	message.button.gun = gun;
+	message.button.name = name;
+	message.button.pressed = pressed;
+	sampler_push(sampler, &message);
+}
+
+/* Steps go through every corner of the first screen, then the next one... */
+static void sampler_prompt(Sampler *sampler, int step)
+{
+	const int cornerCount = sampler->screens.rects[0].cornerCount;
+	Message message;
+	message.type = MESSAGE_PROMPT;
+	message.prompt.screen = step / cornerCount;
+	message.prompt.corner = calibrationOrder[cornerCount - 2][step % cornerCount];
+	sampler_push(sampler, &message);
+}
+
+static void sampler_kick(Sampler *sampler, int gun, uint64_t time)
+{
+	atomic_store_explicit(&sampler->kicks[gun], time, memory_order_release);
+	sem_post(&sampler->wake);
+}
+
+static void sampler_xr_error(Sampler *sampler, const char *function, XrResult result)
+{
+	Message message;
+	message.type = MESSAGE_XR_ERROR;
+	message.xr.function = function;
+	message.xr.result = result;
+	sampler_push(sampler, &message);
+	if (result == XR_ERROR_SESSION_LOST)
+	{
+		sampler_stop(sampler, SESSION_END_LOST);
+		return;
+	}
+	sampler->returnCode = -8;
+	sampler_stop(sampler, SESSION_END_ERROR);
+}
+
+/* Pins the calling thread if asked to, then tries for SCHED_FIFO, then a high
+ * nice value. Failures are reported but aren't fatal.
+ */
+static void sampler_set_priority(Sampler *sampler)
+{
+	const Options *opts = sampler->opts;
+	struct sched_param param;
+	Message message;
+	int err;
+
+	if (opts->samplerCPU >= 0)
+	{
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(opts->samplerCPU, &cpus);
+		err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+		if (err != 0)
+		{
+			message.type = MESSAGE_AFFINITY_FAILED;
+			message.error = err;
+			sampler_push(sampler, &message);
+		}
+	}
+
+	if (opts->samplerPriority == 0)
+	{
+		return;
+	}
+
+	param.sched_priority = opts->samplerPriority;
+	err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+	if (err == 0)
+	{
+		return;
+	}
+
+	/* No RT privileges, see if we can at least bump the nice value */
+	if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), -10) == 0)
+	{
+		return;
+	}
+	message.type = MESSAGE_PRIORITY_FAILED;
+	message.error = err;
+	sampler_push(sampler, &message);
+}
+
+/* The pointer is normalized to the screen rect, but the game may only use part
+ * of the screen (a 4:3 game on a 16:9 display, say), and the ABS axes can have
+ * any range. Both are folded into one scale and offset per axis.
+ */
+static void sampler_init_axes(Sampler *sampler)
+{
+	const Options *opts = sampler->opts;
+	const float screen[2] = { (float) opts->screenWidth, (float) opts->screenHeight };
+	const int axisMax[2] = { opts->axisMaxX, opts->axisMaxY };
+	int i;
+
+	for (i = 0; i < 2; i += 1)
+	{
+		const float regionStart = opts->region[i] / screen[i];
+		const float regionSize = opts->region[2 + i] / screen[i];
+		sampler->axisScale[i] = axisMax[i] / regionSize;
+		sampler->axisOffset[i] = -regionStart * sampler->axisScale[i];
+	}
+}
+
+/* Returns 0 if the pointer is outside of the region */
+static int sampler_pointer_to_axis(Sampler *sampler, float x, float y, int *axisX, int *axisY)
+{
+	const long resultX = lrintf((x * sampler->axisScale[0]) + sampler->axisOffset[0]);
+	const long resultY = lrintf((y * sampler->axisScale[1]) + sampler->axisOffset[1]);
+
+	if (	resultX < 0 || resultX > sampler->opts->axisMaxX ||
+		resultY < 0 || resultY > sampler->opts->axisMaxY	)
+	{
+		return 0;
+	}
+	*axisX = (int) resultX;
+	*axisY = (int) resultY;
+	return 1;
+}
+
+/* Moves a gun in or out of the offscreen state. Parking sends 0,0 and then
+ * forgets the last axis values, so the real position goes out again as soon as
+ * the gun comes back.
+ */
+static void sampler_set_offscreen(Sampler *sampler, int index, int offscreen)
+{
+	Gun *gun = &sampler->guns[index];
+	Message message;
+
+	gun->offscreen = offscreen;
+	gun->hitStreak = 0;
+	if (offscreen)
+	{
+		counter_add(&sampler->stats, COUNTER_OFFSCREEN, 1);
+		if (sampler->opts->offscreen & OFFSCREEN_PARK)
+		{
+#ifdef __linux__
+			batch_push(&gun->batch, EV_ABS, ABS_X, 0);
+			batch_push(&gun->batch, EV_ABS, ABS_Y, 0);
+#endif
+			gun->axisX = -1;
+			gun->axisY = -1;
+		}
+	}
+
+	message.type = MESSAGE_OFFSCREEN;
+	message.offscreen.gun = index;
+	message.offscreen.offscreen = offscreen;
+	sampler_push(sampler, &message);
+}
+
+/* Same idea as sampler_set_offscreen, for --tracking-loss */
+static void sampler_set_tracking_lost(Sampler *sampler, int index, int lost)
+{
+	Gun *gun = &sampler->guns[index];
+	Message message;
+
+	gun->trackingLost = lost;
+	if (lost)
+	{
+		counter_add(&sampler->stats, COUNTER_TRACKING_LOST, 1);
+		if (sampler->opts->trackingLoss == TRACKING_LOSS_PARK)
+		{
+#ifdef __linux__
+			batch_push(&gun->batch, EV_ABS, ABS_X, 0);
+			batch_push(&gun->batch, EV_ABS, ABS_Y, 0);
+#endif
+			gun->axisX = -1;
+			gun->axisY = -1;
+		}
+	}
+
+	message.type = MESSAGE_TRACKING;
+	message.tracking.gun = index;
+	message.tracking.lost = lost;
+	sampler_push(sampler, &message);
+}
+
+/* Whether an axis is worth sending. With a deadband, the axis holds still
+ * until the pointer has moved past it, then jumps straight to the new value.
+ */
+static int axis_changed(int value, int last, int deadband)
+{
+	return (last < 0) || (abs(value - last) > deadband);
+}
+
+/* Swaps a stale pose for an extrapolated one, see pose_extrapolate. Live only,
+ * and the result is what gets recorded, so a replay maps the same poses.
+ */
+static void sampler_upsample(Sampler *sampler, Sample *sample, const PoseVelocity *velocity)
+{
+	Gun *gun = &sampler->guns[sample->gun];
+	const uint64_t age = sample->time - gun->freshTime;
+
+	if (memcmp(&sample->pose, &gun->freshPose, sizeof(XrPosef)) != 0)
+	{
+		gun->freshPose = sample->pose;
+		gun->freshVelocity = *velocity;
+		gun->freshTime = sample->time;
+		gun->upsampledPose = sample->pose;
+		gun->nextUpsample = sample->time + sampler->upsamplePeriod;
+		return;
+	}
+
+	if (	sample->time >= gun->nextUpsample &&
+		age <= UPSAMPLE_MAX_NS &&
+		gun->freshVelocity.flags != 0	)
+	{
+		pose_extrapolate(
+			&gun->freshPose,
+			&gun->freshVelocity,
+			age / (float) NS_PER_SEC,
+			&gun->upsampledPose
+		);
+		gun->nextUpsample += sampler->upsamplePeriod;
+		if (gun->nextUpsample <= sample->time)
+		{
+			gun->nextUpsample = sample->time + sampler->upsamplePeriod;
+		}
+		counter_add(&sampler->stats, COUNTER_UPSAMPLED, 1);
+	}
+	sample->pose = gun->upsampledPose;
+}
+
+/* Maps up to POSE_BATCH_SIZE samples in one pose_batch_to_pointer call ahead
+ * of sampler_process. Only MAPPING_RAY with one screen has a batched version,
+ * and only once calibrated; otherwise sampler_process maps each sample itself.
+ */
+static void sampler_map_batch(Sampler *sampler, Sample *samples, int count)
+{
+	PoseBatch batch;
+	float x[POSE_BATCH_SIZE], y[POSE_BATCH_SIZE];
+	uint8_t hits[POSE_BATCH_SIZE];
+	int i;
+
+	if (	sampler->state != PLAYING ||
+		sampler->opts->mapping != MAPPING_RAY ||
+		sampler->screens.count > 1 ||
+		count == 0	)
+	{
+		return;
+	}
+
+	batch.count = count;
+	for (i = 0; i < count; i += 1)
+	{
+		pose_batch_set(&batch, i, &samples[i].pose);
+	}
+	for (; (i & 3) != 0; i += 1)
+	{
+		pose_batch_set(&batch, i, &samples[0].pose);
+	}
+	pose_batch_to_pointer(&batch, &sampler->screens.rects[0], x, y, hits);
+	for (i = 0; i < count; i += 1)
+	{
+		samples[i].mapped = 1;
+		samples[i].hit = hits[i] && pointer_on_rect(x[i], y[i]);
+		screens_to_target(&sampler->screens, 0, &x[i], &y[i]);
+		samples[i].pointerX = x[i];
+		samples[i].pointerY = y[i];
+	}
+}
+
+/* Everything after the sample has been taken: calibration, buttons, pointer
+ * and uinput. This is shared between live sampling and trace replay, so it
+ * must not know or care where the sample came from.
+ */
+static void sampler_process(Sampler *sampler, const Sample *sample)
+{
+	const Options *opts = sampler->opts;
+	Screens *screens = &sampler->screens;
+	Gun *gun = &sampler->guns[sample->gun];
+	uint64_t stageStart, stageEnd;
+	int i;
+
+	if (sampler->state == RECORDING)
+	{
+		if (	sample->buttons[BUTTON_FIRE] &&
+			sample->changed[BUTTON_FIRE] &&
+			(sample->locationFlags & sampler->trackingFlags) != sampler->trackingFlags	)
+		{
+			counter_add(&sampler->stats, COUNTER_UNTRACKED, 1);
+			sampler_message(sampler, MESSAGE_CORNER_UNTRACKED);
+		}
+		else if (sample->buttons[BUTTON_FIRE] && sample->changed[BUTTON_FIRE])
+		{
+			Message message;
+			const int cornerCount = screens->rects[0].cornerCount;
+			const int screen = sampler->calibrationStep / cornerCount;
+			ScreenRect *rect = &screens->rects[screen];
+			const Corner corner = calibrationOrder[cornerCount - 2][sampler->calibrationStep % cornerCount];
+			rect->corners[corner] = sample->pose.position;
+
+			message.type = MESSAGE_CORNER;
+			message.recorded.screen = screen;
+			message.recorded.corner = corner;
+			message.recorded.position = sample->pose.position;
+			sampler_push(sampler, &message);
+
+			sampler->calibrationStep += 1;
+			if ((sampler->calibrationStep % cornerCount) != 0)
+			{
+				sampler_prompt(sampler, sampler->calibrationStep);
+			}
+			else if (!screen_rect_calibrate(rect))
+			{
+				/* Just this screen, the ones before it were fine */
+				sampler_message(sampler, MESSAGE_CALIBRATION_FAILED);
+				sampler->calibrationStep = screen * cornerCount;
+				sampler_prompt(sampler, sampler->calibrationStep);
+			}
+			else if (sampler->calibrationStep < (screens->count * cornerCount))
+			{
+				sampler_prompt(sampler, sampler->calibrationStep);
+			}
+			else
+			{
+				screens_prepare(screens);
+				sampler->state = PLAYING;
+
+				/* Not sampler_push, the cache gets saved at any verbosity */
+				message.type = MESSAGE_CALIBRATED;
+				ring_push(&sampler->ring, &message);
+			}
+		}
+		return;
+	}
+
+	/* Quit */
+	if (	opts->pauseButton >= 0 &&
+		sample->buttons[BUTTON_FIRE] &&
+		sample->buttons[opts->pauseButton]	)
+	{
+		sampler_stop(sampler, SESSION_END_QUIT);
+	}
+
+	/* Tracking, nothing below touches the pose without it */
+	const int tracked = (sample->locationFlags & sampler->trackingFlags) == sampler->trackingFlags;
+	const int regained = tracked && gun->trackingLost;
+	PointerResult pointer = POINTER_SAME;
+	int moved = 0;
+
+	if (tracked == gun->trackingLost)
+	{
+		sampler_set_tracking_lost(sampler, sample->gun, !tracked);
+	}
+
+	/* Pointer */
+	stageStart = now_ns();
+	if (tracked)
+	{
+		pointer = sample->mapped ?
+			pointer_update(
+				sample->hit,
+				sample->pointerX,
+				sample->pointerY,
+				&gun->rawX,
+				&gun->rawY
+			) :
+			screens_to_pointer(
+				screens,
+				opts->mapping,
+				&sample->pose,
+				&gun->screen,
+				&gun->rawX,
+				&gun->rawY
+			);
+		moved = (pointer == POINTER_MOVED);
+		if (opts->filter.mode == FILTER_NONE)
+		{
+			gun->mouseX = gun->rawX;
+			gun->mouseY = gun->rawY;
+		}
+		else if (moved || gun->filter.primed)
+		{
+			/* Keep filtering while the pose is still, so it settles */
+			FilterParams params = opts->filter;
+			float x = gun->rawX, y = gun->rawY;
+			params.minCutoff = TUNABLE(sampler, filterMinCutoff);
+			params.beta = TUNABLE(sampler, filterBeta);
+			filter_apply(&gun->filter, &params, sample->poseTime, &x, &y);
+			moved = (x != gun->mouseX) || (y != gun->mouseY);
+			gun->mouseX = x;
+			gun->mouseY = y;
+		}
+		stageEnd = now_ns();
+		histogram_record(&sampler->stats.stages[STAGE_MAP], stageEnd - stageStart);
+		stageStart = stageEnd;
+
+		/* Offscreen, straight from the hit test above */
+		if (pointer == POINTER_MISS)
+		{
+			counter_add(&sampler->stats, COUNTER_POINTER_MISSES, 1);
+			gun->hitStreak = 0;
+			if (	opts->offscreen != OFFSCREEN_NONE &&
+				!gun->offscreen &&
+				(sample->poseTime - gun->lastHit) >= (uint64_t) opts->offscreenDelay	)
+			{
+				sampler_set_offscreen(sampler, sample->gun, 1);
+			}
+		}
+		else
+		{
+			gun->lastHit = sample->poseTime;
+			if (gun->offscreen)
+			{
+				gun->hitStreak += 1;
+				if (gun->hitStreak >= OFFSCREEN_EXIT_SAMPLES)
+				{
+					sampler_set_offscreen(sampler, sample->gun, 0);
+					moved = 1; /* Unpark */
+				}
+			}
+		}
+	}
+	else
+	{
+		counter_add(&sampler->stats, COUNTER_UNTRACKED, 1);
+	}
+	moved |= regained; /* Unpark */
+
+	/* Buttons. The report is stamped with the earliest real change time, so a
+	 * game that reads MSC_TIMESTAMP knows when the trigger actually broke,
+	 * rather than when we got around to noticing
+	 */
+#ifdef __linux__
+	uint64_t changeTime = 0;
+#endif
+	for (i = 0; i < opts->buttonCount; i += 1)
+	{
+		if (sample->changed[i])
+		{
+#ifdef __linux__
+			if (	sample->changeTimes[i] != 0 &&
+				(changeTime == 0 || sample->changeTimes[i] < changeTime)	)
+			{
+				changeTime = sample->changeTimes[i];
+			}
+			int key = sampler->buttonKeys[i];
+			if (i == BUTTON_FIRE)
+			{
+				if (sample->buttons[i])
+				{
+					gun->fireKey = (gun->offscreen && (opts->offscreen & OFFSCREEN_RELOAD)) ?
+						opts->reloadKey :
+						key;
+				}
+				key = gun->fireKey;
+			}
+			batch_push(&gun->batch, EV_KEY, key, sample->buttons[i]);
+#endif
+			sampler_button(sampler, sample->gun, opts->buttons[i].label, sample->buttons[i]);
+		}
+	}
+
+	if (moved && !(gun->offscreen && (opts->offscreen & OFFSCREEN_PARK)))
+	{
+		const int deadband = TUNABLE(sampler, deadband);
+		int axisX, axisY;
+
+		if (	TUNABLE(sampler, verbosity) >= LOG_DEBUG &&
+			sample->time >= gun->nextPointerLog	)
+		{
+			Message message;
+			message.type = MESSAGE_POINTER;
+			message.pointer.gun = sample->gun;
+			message.pointer.x = gun->mouseX * opts->screenWidth;
+			message.pointer.y = gun->mouseY * opts->screenHeight;
+			sampler_push(sampler, &message);
+
+			gun->nextPointerLog = sample->time + sampler->pointerLogPeriod;
+		}
+
+		/* Only send what actually changed after quantizing */
+		if (sampler_pointer_to_axis(sampler, gun->mouseX, gun->mouseY, &axisX, &axisY))
+		{
+			unsigned int sent = 0;
+			if (axis_changed(axisX, gun->axisX, deadband))
+			{
+#ifdef __linux__
+				batch_push(&gun->batch, EV_ABS, ABS_X, axisX);
+#endif
+				gun->axisX = axisX;
+				sent += 1;
+			}
+			if (axis_changed(axisY, gun->axisY, deadband))
+			{
+#ifdef __linux__
+				batch_push(&gun->batch, EV_ABS, ABS_Y, axisY);
+#endif
+				gun->axisY = axisY;
+				sent += 1;
+			}
+			counter_add(&sampler->stats, COUNTER_ABS_SENT, sent);
+			counter_add(&sampler->stats, COUNTER_ABS_SUPPRESSED, 2 - sent);
+		}
+	}
+
+	/* Submit everything from this frame as one report */
+#ifdef __linux__
+	const int emitted = gun->batch.count > 0;
+	if (emitted && opts->latencyTest > 0)
+	{
+		batch_push(&gun->batch, EV_MSC, MSC_TIMESTAMP, (int) (uint32_t) (sample->time / 1000));
+	}
+	else if (emitted && changeTime != 0)
+	{
+		batch_push(&gun->batch, EV_MSC, MSC_TIMESTAMP, (int) (uint32_t) (changeTime / 1000));
+	}
+	const int writeError = batch_flush(sampler->fds[sample->gun], &gun->batch);
+	if (emitted)
+	{
+		stageEnd = now_ns();
+		histogram_record(&sampler->stats.stages[STAGE_EMIT], stageEnd - stageStart);
+		histogram_record(
+			&sampler->stats.stages[STAGE_POSE_TO_UINPUT],
+			stageEnd - sample->time
+		);
+	}
+	if (writeError != 0 && writeError != gun->lastWriteError)
+	{
+		Message message;
+		message.type = MESSAGE_WRITE_ERROR;
+		message.write.gun = sample->gun;
+		message.write.error = writeError;
+		sampler_push(sampler, &message);
+	}
+	gun->lastWriteError = writeError;
+#endif
+
+	/* Kickback, on the press and then at the autofire rate while held */
+	if (sampler->kickback != XR_NULL_HANDLE && opts->kickAmplitude > 0.0f)
+	{
+		if (sample->buttons[BUTTON_FIRE] && sample->changed[BUTTON_FIRE])
+		{
+			sampler_kick(sampler, sample->gun, sample->time);
+			gun->nextKick = sample->poseTime + sampler->autofirePeriod;
+		}
+		else if (	sampler->autofirePeriod > 0 &&
+				sample->buttons[BUTTON_FIRE] &&
+				sample->poseTime >= gun->nextKick	)
+		{
+			sampler_kick(sampler, sample->gun, sample->time);
+			gun->nextKick += sampler->autofirePeriod;
+			if (gun->nextKick <= sample->poseTime)
+			{
+				/* Fell behind (unfocused?), don't kick in a burst */
+				gun->nextKick = sample->poseTime + sampler->autofirePeriod;
+			}
+		}
+	}
+}
+
+/* --shot-pose doesn't trust the runtime's pose history past this */
+#define SHOT_POSE_MAX_AGE_NS 100000000 /* 100ms */
+
+static void sampler_live(Sampler *sampler)
+{
+	const Options *opts = sampler->opts;
+	XrResult res;
+	XrActiveActionSet activeSet;
+	XrActionsSyncInfo syncInfo;
+	XrActionStateGetInfo getInfo;
+#ifdef XR_KHR_locate_spaces
+	XrSpacesLocateInfoKHR locateInfo;
+	XrSpaceLocationsKHR locations;
+	XrSpaceLocationDataKHR locationData[MAX_GUNS];
+	XrSpaceVelocitiesKHR velocities;
+	XrSpaceVelocityDataKHR velocityData[MAX_GUNS];
+#endif
+	PoseVelocity gunVelocities[MAX_GUNS];
+	const int upsample = (opts->upsampleRate > 0);
+	TimeBase timeBase;
+	Pacer pacer;
+	int gun, i;
+
+	#define SAMPLER_CHECK_ERROR(name) \
+		if (res != XR_SUCCESS) \
+		{ \
+			sampler_xr_error(sampler, #name, res); \
+			break; \
+		}
+
+	activeSet.actionSet = sampler->actionSet;
+	activeSet.subactionPath = XR_NULL_PATH;
+
+	syncInfo.type = XR_TYPE_ACTIONS_SYNC_INFO;
+	syncInfo.next = NULL;
+	syncInfo.countActiveActionSets = 1;
+	syncInfo.activeActionSets = &activeSet;
+
+	getInfo.type = XR_TYPE_ACTION_STATE_GET_INFO;
+	getInfo.next = NULL;
+
+#ifdef XR_KHR_locate_spaces
+	locateInfo.type = XR_TYPE_SPACES_LOCATE_INFO_KHR;
+	locateInfo.next = NULL;
+	locateInfo.baseSpace = sampler->baseSpace;
+	locateInfo.spaceCount = opts->guns;
+	locateInfo.spaces = sampler->aimSpaces;
+
+	velocities.type = XR_TYPE_SPACE_VELOCITIES_KHR;
+	velocities.next = NULL;
+	velocities.velocityCount = opts->guns;
+	velocities.velocities = velocityData;
+	memset(velocityData, '\0', sizeof(velocityData));
+
+	locations.type = XR_TYPE_SPACE_LOCATIONS_KHR;
+	locations.next = upsample ? &velocities : NULL;
+	locations.locationCount = opts->guns;
+	locations.locations = locationData;
+#endif
+
+	time_base_init(&timeBase, sampler->instance, sampler->pxrConvertTimespecTimeToTimeKHR);
+	pacer_init(&pacer, opts->pollRate, &sampler->resume);
+
+	while (atomic_load_explicit(&sampler->run, memory_order_relaxed))
+	{
+		uint64_t stageStart, stageEnd;
+		const uint64_t iterationStart = now_ns();
+
+		#define STAGE_DONE(stage) \
+			stageEnd = now_ns(); \
+			histogram_record(&sampler->stats.stages[stage], stageEnd - stageStart); \
+			stageStart = stageEnd;
+
+		stageStart = iterationStart;
+		res = xrSyncActions(sampler->session, &syncInfo);
+		STAGE_DONE(STAGE_SYNC)
+		if (res == XR_SUCCESS)
+		{
+			XrTime now, time;
+			XrTime shotTimes[MAX_GUNS]; /* When fire was pulled, 0 if it wasn't */
+			XrSpaceLocation aimState;
+			XrSpaceVelocity aimVelocity;
+			XrActionStateBoolean buttonState;
+			Sample samples[MAX_GUNS];
+
+			/* Calibration only ever looks at fire, and only needs a pose
+			 * for the samples where it was just pulled
+			 */
+			const int recording = (sampler->state == RECORDING);
+			const int buttonCount = recording ? 1 : opts->buttonCount;
+			int needPose = !recording;
+
+			memset(samples, '\0', sizeof(samples));
+			const uint64_t sampleTime = now_ns();
+
+			for (gun = 0; gun < opts->guns && res == XR_SUCCESS; gun += 1)
+			{
+				samples[gun].gun = gun;
+				samples[gun].time = sampleTime;
+				samples[gun].poseTime = samples[gun].time;
+				shotTimes[gun] = 0;
+				getInfo.subactionPath = sampler->handPaths[gun];
+				for (i = 0; i < buttonCount; i += 1)
+				{
+					getInfo.action = sampler->buttonActions[i];
+					buttonState.type = XR_TYPE_ACTION_STATE_BOOLEAN;
+					buttonState.next = NULL;
+					res = xrGetActionStateBoolean(sampler->session, &getInfo, &buttonState);
+					if (res != XR_SUCCESS)
+					{
+						break;
+					}
+					samples[gun].buttons[i] = buttonState.currentState;
+					samples[gun].changed[i] = buttonState.changedSinceLastSync;
+					if (buttonState.changedSinceLastSync && buttonState.lastChangeTime > 0)
+					{
+						/* Best effort, the report just goes out without it */
+						time_base_from_xr(
+							&timeBase,
+							sampleTime,
+							buttonState.lastChangeTime,
+							&samples[gun].changeTimes[i]
+						);
+						if (i == BUTTON_FIRE && buttonState.currentState)
+						{
+							shotTimes[gun] = buttonState.lastChangeTime;
+						}
+					}
+				}
+				needPose |= (samples[gun].buttons[BUTTON_FIRE] && samples[gun].changed[BUTTON_FIRE]);
+			}
+			SAMPLER_CHECK_ERROR(xrGetActionStateBoolean)
+			STAGE_DONE(STAGE_ACTIONS)
+
+			if (needPose)
+			{
+				res = time_base_to_xr(&timeBase, sampleTime, &now);
+				SAMPLER_CHECK_ERROR(xrConvertTimespecTimeToTimeKHR)
+
+				/* Ask the runtime to extrapolate the pose to when the game will
+				 * actually see it, to hide compositor/game frame latency
+				 */
+				time = now + TUNABLE(sampler, lookahead);
+
+				/* Every gun in one call if the runtime (and the headers we
+				 * were built with) let us
+				 */
+#ifdef XR_KHR_locate_spaces
+				if (sampler->pxrLocateSpacesKHR != NULL)
+				{
+					locateInfo.time = time;
+					res = sampler->pxrLocateSpacesKHR(sampler->session, &locateInfo, &locations);
+					SAMPLER_CHECK_ERROR(xrLocateSpacesKHR)
+					for (gun = 0; gun < opts->guns; gun += 1)
+					{
+						samples[gun].locationFlags = locationData[gun].locationFlags;
+						samples[gun].pose = locationData[gun].pose;
+						gunVelocities[gun].flags = velocityData[gun].velocityFlags;
+						gunVelocities[gun].linear = velocityData[gun].linearVelocity;
+						gunVelocities[gun].angular = velocityData[gun].angularVelocity;
+					}
+				}
+				else
+#endif
+				{
+					for (gun = 0; gun < opts->guns; gun += 1)
+					{
+						aimVelocity.type = XR_TYPE_SPACE_VELOCITY;
+						aimVelocity.next = NULL;
+						aimVelocity.velocityFlags = 0;
+						aimState.type = XR_TYPE_SPACE_LOCATION;
+						aimState.next = upsample ? &aimVelocity : NULL;
+						res = xrLocateSpace(sampler->aimSpaces[gun], sampler->baseSpace, time, &aimState);
+						if (res != XR_SUCCESS)
+						{
+							break;
+						}
+						samples[gun].locationFlags = aimState.locationFlags;
+						samples[gun].pose = aimState.pose;
+						gunVelocities[gun].flags = aimVelocity.velocityFlags;
+						gunVelocities[gun].linear = aimVelocity.linearVelocity;
+						gunVelocities[gun].angular = aimVelocity.angularVelocity;
+					}
+					SAMPLER_CHECK_ERROR(xrLocateSpace)
+				}
+				STAGE_DONE(STAGE_LOCATE)
+
+				if (upsample && !recording)
+				{
+					for (gun = 0; gun < opts->guns; gun += 1)
+					{
+						sampler_upsample(sampler, &samples[gun], &gunVelocities[gun]);
+					}
+				}
+
+				/* Go back for where the gun was pointing when the trigger
+				 * broke, up to a whole iteration before the pose above. The
+				 * next sample goes back to the usual pose. Runtimes only keep
+				 * so much history (past it is XR_ERROR_TIME_INVALID), so
+				 * anything odd keeps the usual pose and is just counted.
+				 */
+				for (gun = 0; gun < opts->guns && opts->shotPose; gun += 1)
+				{
+					if (shotTimes[gun] == 0)
+					{
+						continue;
+					}
+					if (	shotTimes[gun] > now ||
+						(now - shotTimes[gun]) > SHOT_POSE_MAX_AGE_NS	)
+					{
+						counter_add(&sampler->stats, COUNTER_SHOT_POSE_MISSES, 1);
+						continue;
+					}
+					aimState.type = XR_TYPE_SPACE_LOCATION;
+					aimState.next = NULL;
+					if (	xrLocateSpace(sampler->aimSpaces[gun], sampler->baseSpace, shotTimes[gun], &aimState) == XR_SUCCESS &&
+						(aimState.locationFlags & sampler->trackingFlags) == sampler->trackingFlags	)
+					{
+						samples[gun].locationFlags = aimState.locationFlags;
+						samples[gun].pose = aimState.pose;
+						counter_add(&sampler->stats, COUNTER_SHOT_POSES, 1);
+					}
+					else
+					{
+						counter_add(&sampler->stats, COUNTER_SHOT_POSE_MISSES, 1);
+					}
+				}
+			}
+
+			sampler_map_batch(sampler, samples, opts->guns);
+			for (gun = 0; gun < opts->guns; gun += 1)
+			{
+				if (opts->tracePath != NULL)
+				{
+					TraceRecord record;
+					trace_record_from_sample(&record, &samples[gun]);
+					trace_ring_push(&sampler->traceRing, &record);
+				}
+
+				sampler_process(sampler, &samples[gun]);
+			}
+		}
+		else if (res == XR_SESSION_LOSS_PENDING)
+		{
+			sampler_message(sampler, MESSAGE_SESSION_LOST);
+			sampler_stop(sampler, SESSION_END_LOST);
+		}
+		else if (res != XR_SESSION_NOT_FOCUSED)
+		{
+			SAMPLER_CHECK_ERROR(xrSyncActions)
+		}
+
+		histogram_record(&sampler->stats.stages[STAGE_ITERATION], now_ns() - iterationStart);
+		#undef STAGE_DONE
+
+		/* Per XR_MND_headless, we need to throttle our event loop */
+		pacer_wait(&pacer, res == XR_SUCCESS);
+	}
+
+	#undef SAMPLER_CHECK_ERROR
+}
+
+/* Feeds a recorded trace through sampler_process, either with the original
+ * timing scaled by --replay-speed or, at speed 0, as fast as possible.
+ */
+static void sampler_replay(Sampler *sampler)
+{
+	const Trace *trace = sampler->replay;
+	const double speed = sampler->opts->replaySpeed;
+	const uint64_t replayStart = now_ns();
+	const uint64_t traceStart = (trace->count > 0) ? trace->records[0].time : 0;
+	struct timespec deadline;
+	Message message;
+	Sample samples[POSE_BATCH_SIZE];
+	size_t i = 0, replayed = 0;
+	int count, j;
+
+	while (i < trace->count && atomic_load_explicit(&sampler->run, memory_order_relaxed))
+	{
+		/* Decode and map a batch at a time */
+		count = 0;
+		for (; i < trace->count && count < POSE_BATCH_SIZE; i += 1)
+		{
+			if (trace->records[i].gun < sampler->opts->guns)
+			{
+				trace_record_to_sample(&trace->records[i], &samples[count]);
+				count += 1;
+			}
+		}
+		sampler_map_batch(sampler, samples, count);
+
+		for (j = 0; j < count; j += 1)
+		{
+			Sample *sample = &samples[j];
+
+			if (!atomic_load_explicit(&sampler->run, memory_order_relaxed))
+			{
+				break;
+			}
+
+			if (speed > 0.0)
+			{
+				const uint64_t target = replayStart + (uint64_t) (
+					(sample->poseTime - traceStart) / speed
+				);
+				deadline.tv_sec = target / NS_PER_SEC;
+				deadline.tv_nsec = target % NS_PER_SEC;
+				while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+			}
+
+			/* Latency stats should reflect this run, not the recording */
+			sample->time = now_ns();
+			sampler_process(sampler, sample);
+			histogram_record(&sampler->stats.stages[STAGE_ITERATION], now_ns() - sample->time);
+			replayed += 1;
+		}
+	}
+
+	/* Not sampler_push, the replay summary shows at any verbosity */
+	message.type = MESSAGE_REPLAY_DONE;
+	message.replay.samples = replayed;
+	message.replay.elapsed = now_ns() - replayStart;
+	ring_push(&sampler->ring, &message);
+	sampler_stop(sampler, SESSION_END_QUIT);
+}
+
+static void* sampler_thread(void *data)
+{
+	Sampler *sampler = (Sampler*) data;
+
+	int i;
+
+	sampler->calibrationStep = 0;
+	sampler->pointerLogPeriod = (sampler->opts->pointerLogRate > 0) ?
+		(NS_PER_SEC / sampler->opts->pointerLogRate) :
+		0;
+	sampler->autofirePeriod = (sampler->opts->autofireRate > 0) ?
+		(NS_PER_SEC / sampler->opts->autofireRate) :
+		0;
+	sampler->upsamplePeriod = (sampler->opts->upsampleRate > 0) ?
+		(NS_PER_SEC / sampler->opts->upsampleRate) :
+		0;
+	sampler->trackingFlags =
+		XR_SPACE_LOCATION_ORIENTATION_VALID_BIT |
+		XR_SPACE_LOCATION_POSITION_VALID_BIT;
+	if (sampler->opts->requireTracked)
+	{
+		sampler->trackingFlags |=
+			XR_SPACE_LOCATION_ORIENTATION_TRACKED_BIT |
+			XR_SPACE_LOCATION_POSITION_TRACKED_BIT;
+	}
+	sampler_init_axes(sampler);
+	for (i = 0; i < MAX_GUNS; i += 1)
+	{
+		Gun *gun = &sampler->guns[i];
+		gun->nextKick = 0;
+		memset(&gun->freshPose, '\0', sizeof(gun->freshPose));
+		gun->freshVelocity.flags = 0;
+		gun->freshTime = 0;
+		gun->upsampledPose = gun->freshPose;
+		gun->nextUpsample = 0;
+		gun->rawX = 0;
+		gun->rawY = 0;
+		filter_reset(&gun->filter);
+		gun->mouseX = 0;
+		gun->mouseY = 0;
+		gun->axisX = -1;
+		gun->axisY = -1;
+		gun->offscreen = 0;
+		gun->trackingLost = 0;
+		gun->lastHit = 0;
+		gun->screen = 0;
+		gun->hitStreak = 0;
+#ifdef __linux__
+		gun->fireKey = sampler->buttonKeys[BUTTON_FIRE];
+#endif
+		gun->nextPointerLog = 0;
+#ifdef __linux__
+		gun->batch.count = 0;
+		gun->lastWriteError = 0;
+#endif
+	}
+
+	sampler_set_priority(sampler);
+
+	if (sampler->state == RECORDING)
+	{
+		sampler_prompt(sampler, 0);
+	}
+
+	if (sampler->replay != NULL)
+	{
+		sampler_replay(sampler);
+	}
+	else
+	{
+		sampler_live(sampler);
+	}
+	return NULL;
+}
+
+static volatile sig_atomic_t statsRequested = 0;
+
+static void on_sigusr1(int sig)
+{
+	(void) sig;
+	statsRequested = 1;
+}
+
+/* Starts the sampler thread with SIGUSR1 blocked, it inherits our mask so
+ * the signal can only land on the service thread and never interrupts
+ * sampling. Returns 0 or the pthread_create error.
+ */
+static int sampler_thread_start(pthread_t *thread, Sampler *sampler)
+{
+	sigset_t signals, previous;
+	int err;
+
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &signals, &previous);
+	err = pthread_create(thread, NULL, sampler_thread, sampler);
+	pthread_sigmask(SIG_SETMASK, &previous, NULL);
+	return err;
+}
+
+/* Writes out the records the sampler has pushed since the last call. Drops
+ * go into the header as soon as they're noticed, so that a recording that
+ * gets cut off still says it has gaps. *trace is closed if writing fails.
+ */
+static void service_trace(Sampler *sampler, FILE **trace)
+{
+	TraceRecord record;
+	unsigned int dropped;
+
+	while (trace_ring_pop(&sampler->traceRing, &record))
+	{
+		if (*trace != NULL && fwrite(&record, sizeof(TraceRecord), 1, *trace) != 1)
+		{
+			printf("Trace write failed, recording stopped\n");
+			fclose(*trace);
+			*trace = NULL;
+		}
+	}
+
+	dropped = atomic_exchange_explicit(&sampler->traceRing.dropped, 0, memory_order_relaxed);
+	if (dropped == 0 || *trace == NULL)
+	{
+		return;
+	}
+	printf("%u trace samples were dropped, the service thread is falling behind\n", dropped);
+	sampler->traceDropped += dropped;
+	if (	fseek(*trace, offsetof(TraceHeader, dropped), SEEK_SET) != 0 ||
+		fwrite(&sampler->traceDropped, sizeof(sampler->traceDropped), 1, *trace) != 1 ||
+		fseek(*trace, 0, SEEK_END) != 0	)
+	{
+		printf("Trace write failed, recording stopped\n");
+		fclose(*trace);
+		*trace = NULL;
+	}
+}
+
+/* Everything the sampler reports ends up here, on the service thread.
+ *
+ * calibrationKey is NULL when replaying, in which case nothing is saved.
+ * *trace is NULL when not recording, and is closed if writing to it fails.
+ */
+static void service_messages(
+	Sampler *sampler,
+	const CalibrationKey *calibrationKey,
+	FILE **trace
+) {
+	Message message;
+	char resString[XR_MAX_RESULT_STRING_SIZE];
+	unsigned int dropped;
+
+	service_trace(sampler, trace);
+	while (ring_pop(&sampler->ring, &message))
+	{
+		switch (message.type)
+		{
+		case MESSAGE_PROMPT:
+			if (sampler->screens.count > 1)
+			{
+				printf("Calibrating screen %d: ", message.prompt.screen + 1);
+			}
+			else
+			{
+				printf("Calibrating: ");
+			}
+			printf(
+				"%s corner, hold the gun against it and pull the trigger\n",
+				cornerNames[message.prompt.corner]
+			);
+			break;
+		case MESSAGE_CORNER:
+			printf("%s ", cornerNames[message.recorded.corner]);
+			if (sampler->screens.count > 1)
+			{
+				printf("of screen %d ", message.recorded.screen + 1);
+			}
+			printf(
+				"is (%.9f, %.9f, %.9f)\n",
+				message.recorded.position.x,
+				message.recorded.position.y,
+				message.recorded.position.z
+			);
+			break;
+		case MESSAGE_CALIBRATED:
+			if (calibrationKey != NULL)
+			{
+				calibration_save(
+					sampler->opts->calibrationPath,
+					calibrationKey,
+					&sampler->screens
+				);
+			}
+			break;
+		case MESSAGE_CALIBRATION_FAILED:
+			printf("Screen corners don't form a rect, starting over\n");
+			break;
+		case MESSAGE_BUTTON:
+			if (sampler->opts->guns > 1)
+			{
+				printf("P%d ", message.button.gun + 1);
+			}
+			printf("%s %s\n", message.button.name, message.button.pressed ? "Press" : "Release");
+			break;
+		case MESSAGE_POINTER:
+			if (sampler->opts->guns > 1)
+			{
+				printf("P%d ", message.pointer.gun + 1);
+			}
+			printf("Pointer: %.9f, %.9f\n", message.pointer.x, message.pointer.y);
+			break;
+		case MESSAGE_OFFSCREEN:
+			if (sampler->opts->guns > 1)
+			{
+				printf("P%d ", message.offscreen.gun + 1);
+			}
+			printf("%s\n", message.offscreen.offscreen ? "Offscreen" : "Back on screen");
+			break;
+		case MESSAGE_TRACKING:
+			if (sampler->opts->guns > 1)
+			{
+				printf("P%d ", message.tracking.gun + 1);
+			}
+			printf("%s\n", message.tracking.lost ? "Tracking lost" : "Tracking is back");
+			break;
+		case MESSAGE_CORNER_UNTRACKED:
+			printf("The gun isn't being tracked, take that shot again\n");
+			break;
+		case MESSAGE_XR_ERROR:
+			xrResultToString(sampler->instance, message.xr.result, resString);
+			printf("%s: %s\n", message.xr.function, resString);
+			break;
+		case MESSAGE_WRITE_ERROR:
+			printf(
+				"uinput write for gun %d failed: %s\n",
+				message.write.gun + 1,
+				strerror(message.write.error)
+			);
+			break;
+		case MESSAGE_SESSION_LOST:
+			printf("Session is getting lost, reconnecting\n");
+			break;
+		case MESSAGE_AFFINITY_FAILED:
+			printf(
+				"Could not pin sampler to CPU %d: %s\n",
+				sampler->opts->samplerCPU,
+				strerror(message.error)
+			);
+			break;
+		case MESSAGE_PRIORITY_FAILED:
+			printf(
+				"Could not raise sampler priority (%s), running at normal priority\n",
+				strerror(message.error)
+			);
+			break;
+		case MESSAGE_REPLAY_DONE:
+			printf(
+				"Replayed %zu samples in %.3f seconds\n",
+				message.replay.samples,
+				message.replay.elapsed / (double) NS_PER_SEC
+			);
+			break;
+		}
+	}
+
+	dropped = atomic_exchange_explicit(&sampler->ring.dropped, 0, memory_order_relaxed);
+	if (dropped > 0)
+	{
+		printf("%u messages were dropped, the service thread is falling behind\n", dropped);
+	}
+	fflush(stdout);
+}
+
+/* Applies whatever kicks the sampler has asked for since the last call */
+static void service_haptics(Sampler *sampler)
+{
+	const Options *opts = sampler->opts;
+	XrHapticActionInfo hapticInfo;
+	XrHapticVibration vibration;
+	char resString[XR_MAX_RESULT_STRING_SIZE];
+	XrResult res;
+	int gun;
+
+	hapticInfo.type = XR_TYPE_HAPTIC_ACTION_INFO;
+	hapticInfo.next = NULL;
+	hapticInfo.action = sampler->kickback;
+
+	vibration.type = XR_TYPE_HAPTIC_VIBRATION;
+	vibration.next = NULL;
+	vibration.duration = opts->kickDuration;
+	vibration.frequency = opts->kickFrequency;
+	vibration.amplitude = opts->kickAmplitude;
+
+	for (gun = 0; gun < opts->guns; gun += 1)
+	{
+		const uint64_t kick = atomic_exchange_explicit(
+			&sampler->kicks[gun],
+			0,
+			memory_order_acquire
+		);
+		if (kick == 0)
+		{
+			continue;
+		}
+
+		hapticInfo.subactionPath = sampler->handPaths[gun];
+		res = xrApplyHapticFeedback(
+			sampler->session,
+			&hapticInfo,
+			(const XrHapticBaseHeader*) &vibration
+		);
+		if (XR_SUCCEEDED(res))
+		{
+			histogram_record(&sampler->stats.stages[STAGE_KICK], now_ns() - kick);
+		}
+		else if (res != sampler->lastKickResult)
+		{
+			/* Only complain once, autofire would spam this */
+			xrResultToString(sampler->instance, res, resString);
+			printf("xrApplyHapticFeedback: %s\n", resString);
+		}
+		sampler->lastKickResult = res;
+	}
+}
+
+#ifdef __linux__
+/* Reads back whatever the guns have sent since the last call, see EvdevReader */
+static void service_latency_test(Sampler *sampler)
+{
+	const Options *opts = sampler->opts;
+	struct input_event events[64];
+	const uint64_t now = now_ns();
+	ssize_t got;
+	int gun, i;
+
+	if (sampler->evdevDeadline == 0)
+	{
+		sampler->evdevDeadline = now + EVDEV_WAIT_NS;
+	}
+
+	for (gun = 0; gun < opts->guns; gun += 1)
+	{
+		EvdevReader *reader = &sampler->evdev[gun];
+		if (reader->failed)
+		{
+			continue;
+		}
+
+		if (reader->fd == -1)
+		{
+			reader->fd = evdev_open(sampler->fds[gun]);
+			if (reader->fd == -1 && (errno != ENOENT || now >= sampler->evdevDeadline))
+			{
+				printf(
+					"Gun %d's evdev node could not be opened for the latency test: %s\n",
+					gun + 1,
+					strerror(errno)
+				);
+				reader->failed = 1;
+			}
+			continue;
+		}
+
+		while ((got = read(reader->fd, events, sizeof(events))) > 0)
+		{
+			for (i = 0; i < (got / (ssize_t) sizeof(events[0])); i += 1)
+			{
+				const struct input_event *ie = &events[i];
+				if (ie->type == EV_MSC && ie->code == MSC_TIMESTAMP)
+				{
+					reader->stamp = (uint32_t) ie->value;
+					reader->stamped = 1;
+				}
+				else if (ie->type == EV_SYN && ie->code == SYN_DROPPED)
+				{
+					reader->dropped = 1;
+				}
+				else if (ie->type == EV_SYN && ie->code == SYN_REPORT)
+				{
+					if (reader->stamped && !reader->dropped)
+					{
+						const uint32_t received = (uint32_t) (
+							((uint64_t) ie->time.tv_sec * 1000000) +
+							ie->time.tv_usec
+						);
+						histogram_record(
+							&sampler->stats.stages[STAGE_POSE_TO_EVDEV],
+							(uint64_t) (uint32_t) (received - reader->stamp) * 1000
+						);
+						if (sampler->latencyTestStart == 0)
+						{
+							sampler->latencyTestStart = now;
+						}
+					}
+					reader->stamped = 0;
+					reader->dropped = 0;
+				}
+			}
+		}
+	}
+
+	if (	sampler->latencyTestStart != 0 &&
+		(now - sampler->latencyTestStart) >= ((uint64_t) opts->latencyTest * NS_PER_SEC)	)
+	{
+		printf("Latency test finished\n");
+		sampler_stop(sampler, SESSION_END_QUIT);
+	}
+}
+#endif
+
+/* Live control, see --control. A Unix socket that takes one command per line:
+ *
+ * - stats: the same report as SIGUSR1
+ * - rates: iterations, uinput writes and counters per second since the
+ *   client's last rates (or since it connected)
+ * - get: the current tunables
+ * - set <tunable> <value>: see controlTunables
+ *
+ * The service thread polls it between events, and nothing here ever blocks,
+ * so a stuck client only stalls itself. To poke at it by hand:
+ * socat - UNIX-CONNECT:<path>
+ */
+#define MAX_CONTROL_CLIENTS 4
+#define MAX_CONTROL_LINE 256
+#define MAX_CONTROL_REPLY 4096
+
+typedef enum ControlTunable
+{
+	CONTROL_LOOKAHEAD, /* ms */
+	CONTROL_DEADBAND,
+	CONTROL_FILTER_MIN_CUTOFF, /* Only matters with --filter one-euro */
+	CONTROL_FILTER_BETA, /* Ditto */
+	CONTROL_VERBOSITY,
+	CONTROL_TUNABLE_COUNT
+} ControlTunable;
+
+static const char *controlTunables[CONTROL_TUNABLE_COUNT] =
+{
+	"lookahead",
+	"deadband",
+	"filter-min-cutoff",
+	"filter-beta",
+	"verbosity"
+};
+
+typedef struct ControlClient
+{
+	int fd; /* -1 if the slot is free */
+	char line[MAX_CONTROL_LINE];
+	size_t length;
+	uint64_t ratesTime;
+	unsigned int ratesIterations;
+	unsigned int ratesWrites;
+	unsigned int ratesCounters[COUNTER_COUNT];
+} ControlClient;
+
+typedef struct Control
+{
+	int fd; /* -1 without --control */
+	const char *path;
+	ControlClient clients[MAX_CONTROL_CLIENTS];
+} Control;
+
+static int control_open(Control *control, const char *path)
+{
+	struct sockaddr_un address;
+	struct stat info;
+	int i;
+
+	control->fd = -1;
+	control->path = path;
+	for (i = 0; i < MAX_CONTROL_CLIENTS; i += 1)
+	{
+		control->clients[i].fd = -1;
+	}
+	if (path == NULL)
+	{
+		return 1;
+	}
+
+	if (strlen(path) >= sizeof(address.sun_path))
+	{
+		printf("--control path is too long: %s\n", path);
+		return 0;
+	}
+	memset(&address, '\0', sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+
+	/* A socket left over from a crash would make bind fail, anything else is
+	 * probably somebody's file
+	 */
+	if (lstat(path, &info) == 0)
+	{
+		if (!S_ISSOCK(info.st_mode))
+		{
+			printf("%s already exists and isn't a socket\n", path);
+			return 0;
+		}
+		unlink(path);
+	}
+
+	control->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (control->fd == -1)
+	{
+		printf("Control socket could not be created: %s\n", strerror(errno));
+		return 0;
+	}
+	if (	bind(control->fd, (struct sockaddr*) &address, sizeof(address)) == -1 ||
+		listen(control->fd, MAX_CONTROL_CLIENTS) == -1	)
+	{
+		printf("%s could not be listened on: %s\n", path, strerror(errno));
+		close(control->fd);
+		control->fd = -1;
+		return 0;
+	}
+	printf("Listening for control commands on %s\n", path);
+	return 1;
+}
+
+static void control_close(Control *control)
+{
+	int i;
+
+	if (control->fd == -1)
+	{
+		return;
+	}
+	for (i = 0; i < MAX_CONTROL_CLIENTS; i += 1)
+	{
+		if (control->clients[i].fd != -1)
+		{
+			close(control->clients[i].fd);
+			control->clients[i].fd = -1;
+		}
+	}
+	close(control->fd);
+	control->fd = -1;
+	unlink(control->path);
+}
+
+static void control_rates_reset(ControlClient *client, Stats *stats)
+{
+	int i;
+
+	client->ratesTime = now_ns();
+	client->ratesIterations = atomic_load_explicit(
+		&stats->stages[STAGE_ITERATION].count,
+		memory_order_relaxed
+	);
+	client->ratesWrites = atomic_load_explicit(
+		&stats->stages[STAGE_EMIT].count,
+		memory_order_relaxed
+	);
+	for (i = 0; i < COUNTER_COUNT; i += 1)
+	{
+		client->ratesCounters[i] = atomic_load_explicit(
+			&stats->counters[i],
+			memory_order_relaxed
+		);
+	}
+}
+
+static void control_rates(ControlClient *client, Stats *stats, FILE *out)
+{
+	const ControlClient last = *client;
+	double seconds;
+	int i;
+
+	control_rates_reset(client, stats);
+	seconds = (client->ratesTime - last.ratesTime) / (double) NS_PER_SEC;
+	if (seconds <= 0.0)
+	{
+		seconds = 1.0 / NS_PER_SEC;
+	}
+
+	/* Unsigned subtraction, so the counters wrapping doesn't matter */
+	fprintf(out, "%-16s %10s\n", "rate (/s)", "per-sec");
+	fprintf(out, "%-16s %10.2f\n", "seconds", seconds);
+	fprintf(
+		out,
+		"%-16s %10.1f\n",
+		"iterations",
+		(client->ratesIterations - last.ratesIterations) / seconds
+	);
+	fprintf(
+		out,
+		"%-16s %10.1f\n",
+		"uinput-writes",
+		(client->ratesWrites - last.ratesWrites) / seconds
+	);
+	for (i = 0; i < COUNTER_COUNT; i += 1)
+	{
+		fprintf(
+			out,
+			"%-16s %10.1f\n",
+			counterNames[i],
+			(client->ratesCounters[i] - last.ratesCounters[i]) / seconds
+		);
+	}
+}
+
+static void control_get(Sampler *sampler, ControlTunable tunable, FILE *out)
+{
+	fprintf(out, "%-18s ", controlTunables[tunable]);
+	switch (tunable)
+	{
+	case CONTROL_LOOKAHEAD:
+		fprintf(out, "%.1f ms\n", TUNABLE(sampler, lookahead) / 1000000.0);
+		break;
+	case CONTROL_DEADBAND:
+		fprintf(out, "%d\n", TUNABLE(sampler, deadband));
+		break;
+	case CONTROL_FILTER_MIN_CUTOFF:
+		fprintf(out, "%.3f Hz\n", TUNABLE(sampler, filterMinCutoff));
+		break;
+	case CONTROL_FILTER_BETA:
+		fprintf(out, "%.3f\n", TUNABLE(sampler, filterBeta));
+		break;
+	case CONTROL_VERBOSITY:
+		fprintf(out, "%s\n", logLevelNames[TUNABLE(sampler, verbosity)]);
+		break;
+	default:
+		break;
+	}
+}
+
+/* Same limits as the command line, so anything set here could've been passed
+ * on startup instead
+ */
+static int control_set(
+	Sampler *sampler,
+	ControlTunable tunable,
+	const char *value,
+	FILE *out
+) {
+	char *end;
+	const double number = strtod(value, &end);
+	const int isNumber = (end != value && *end == '\0');
+	int level;
+
+	switch (tunable)
+	{
+	case CONTROL_LOOKAHEAD:
+		if (!isNumber || number < 0.0 || number > 100.0)
+		{
+			fprintf(out, "error: lookahead must be between 0 and 100 ms\n");
+			return 0;
+		}
+		atomic_store_explicit(
+			&sampler->tunables.lookahead,
+			(int64_t) (number * 1000000.0),
+			memory_order_relaxed
+		);
+		break;
+	case CONTROL_DEADBAND:
+		if (!isNumber || number < 0.0)
+		{
+			fprintf(out, "error: deadband must be 0 or greater\n");
+			return 0;
+		}
+		atomic_store_explicit(&sampler->tunables.deadband, (int) number, memory_order_relaxed);
+		break;
+	case CONTROL_FILTER_MIN_CUTOFF:
+		if (!isNumber || number <= 0.0)
+		{
+			fprintf(out, "error: filter-min-cutoff must be greater than 0\n");
+			return 0;
+		}
+		atomic_store_explicit(
+			&sampler->tunables.filterMinCutoff,
+			(float) number,
+			memory_order_relaxed
+		);
+		break;
+	case CONTROL_FILTER_BETA:
+		if (!isNumber || number < 0.0)
+		{
+			fprintf(out, "error: filter-beta must be 0 or greater\n");
+			return 0;
+		}
+		atomic_store_explicit(&sampler->tunables.filterBeta, (float) number, memory_order_relaxed);
+		break;
+	case CONTROL_VERBOSITY:
+		for (level = LOG_ERROR; level <= LOG_DEBUG; level += 1)
+		{
+			if (strcmp(value, logLevelNames[level]) == 0)
+			{
+				break;
+			}
+		}
+		if (level > LOG_DEBUG)
+		{
+			fprintf(out, "error: verbosity must be error, warning, info or debug\n");
+			return 0;
+		}
+		atomic_store_explicit(&sampler->tunables.verbosity, level, memory_order_relaxed);
+		break;
+	default:
+		return 0;
+	}
+	return 1;
+}
+
+static void control_command(
+	Sampler *sampler,
+	ControlClient *client,
+	char *line,
+	FILE *out
+) {
+	char *save;
+	const char *command = strtok_r(line, " \t\r", &save);
+	const char *name, *value;
+	int tunable;
+
+	if (command == NULL)
+	{
+		return;
+	}
+	if (strcmp(command, "stats") == 0)
+	{
+		stats_report(&sampler->stats, out);
+		return;
+	}
+	if (strcmp(command, "rates") == 0)
+	{
+		control_rates(client, &sampler->stats, out);
+		return;
+	}
+	if (strcmp(command, "get") == 0)
+	{
+		for (tunable = 0; tunable < CONTROL_TUNABLE_COUNT; tunable += 1)
+		{
+			control_get(sampler, (ControlTunable) tunable, out);
+		}
+		return;
+	}
+	if (strcmp(command, "set") != 0)
+	{
+		fprintf(out, "error: commands are stats, rates, get and set\n");
+		return;
+	}
+
+	name = strtok_r(NULL, " \t\r", &save);
+	value = strtok_r(NULL, " \t\r", &save);
+	if (name == NULL || value == NULL)
+	{
+		fprintf(out, "error: set <tunable> <value>\n");
+		return;
+	}
+	for (tunable = 0; tunable < CONTROL_TUNABLE_COUNT; tunable += 1)
+	{
+		if (strcmp(name, controlTunables[tunable]) == 0)
+		{
+			break;
+		}
+	}
+	if (tunable == CONTROL_TUNABLE_COUNT)
+	{
+		fprintf(out, "error: tunables are lookahead, deadband, filter-min-cutoff, filter-beta and verbosity\n");
+		return;
+	}
+	if (control_set(sampler, (ControlTunable) tunable, value, out))
+	{
+		control_get(sampler, (ControlTunable) tunable, out);
+		printf("Control: %s set to %s\n", name, value);
+	}
+}
+
+/* Runs one line through control_command and sends whatever it had to say. A
+ * client that can't take the whole reply right away gets dropped.
+ */
+static int control_reply(Sampler *sampler, ControlClient *client, char *line)
+{
+	char reply[MAX_CONTROL_REPLY];
+	FILE *out = fmemopen(reply, sizeof(reply), "w");
+	long length;
+
+	if (out == NULL)
+	{
+		return 0;
+	}
+	control_command(sampler, client, line, out);
+	fflush(out);
+	length = ftell(out);
+	fclose(out);
+
+	if (length <= 0)
+	{
+		return 1;
+	}
+	return send(client->fd, reply, length, MSG_DONTWAIT | MSG_NOSIGNAL) == length;
+}
+
+static void control_service(Control *control, Sampler *sampler)
+{
+	ControlClient *client;
+	char buffer[MAX_CONTROL_LINE];
+	ssize_t got;
+	int fd, i;
+
+	if (control->fd == -1)
+	{
+		return;
+	}
+
+	while ((fd = accept4(control->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+	{
+		for (i = 0; i < MAX_CONTROL_CLIENTS; i += 1)
+		{
+			if (control->clients[i].fd == -1)
+			{
+				break;
+			}
+		}
+		if (i == MAX_CONTROL_CLIENTS)
+		{
+			static const char busy[] = "error: too many control clients\n";
+			send(fd, busy, sizeof(busy) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+			close(fd);
+			continue;
+		}
+		client = &control->clients[i];
+		client->fd = fd;
+		client->length = 0;
+		control_rates_reset(client, &sampler->stats);
+	}
+
+	for (i = 0; i < MAX_CONTROL_CLIENTS; i += 1)
+	{
+		int keep = 1;
+
+		client = &control->clients[i];
+		if (client->fd == -1)
+		{
+			continue;
+		}
+
+		while (keep && (got = recv(client->fd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0)
+		{
+			ssize_t j;
+			for (j = 0; keep && j < got; j += 1)
+			{
+				if (buffer[j] == '\n')
+				{
+					client->line[client->length] = '\0';
+					client->length = 0;
+					keep = control_reply(sampler, client, client->line);
+				}
+				else if (client->length < (MAX_CONTROL_LINE - 1))
+				{
+					client->line[client->length++] = buffer[j];
+				}
+				else
+				{
+					/* Not a command we'd understand anyway */
+					static const char tooLong[] = "error: line is too long\n";
+					send(client->fd, tooLong, sizeof(tooLong) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+					keep = 0;
+				}
+			}
+		}
+		if (keep && (got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)))
+		{
+			keep = 0; /* Hung up */
+		}
+		if (!keep)
+		{
+			close(client->fd);
+			client->fd = -1;
+		}
+	}
+}
+
+/* The service thread's main loop, runs until the sampler stops */
+static void service_run(
+	Sampler *sampler,
+	const CalibrationKey *calibrationKey,
+	FILE **trace,
+	Control *control
+) {
+	XrEventDataBuffer eventData;
+	char resString[XR_MAX_RESULT_STRING_SIZE];
+	XrResult res;
+
+	while (atomic_load(&sampler->run))
+	{
+		struct timespec wait;
+
+		service_haptics(sampler);
+#ifdef __linux__
+		if (sampler->opts->latencyTest > 0)
+		{
+			service_latency_test(sampler);
+		}
+#endif
+
+		/* Drain the event queue, if there is one */
+		res = (sampler->instance != XR_NULL_HANDLE) ? XR_SUCCESS : XR_EVENT_UNAVAILABLE;
+		while (res == XR_SUCCESS)
+		{
+			eventData.type = XR_TYPE_EVENT_DATA_BUFFER;
+			eventData.next = NULL;
+
+			res = xrPollEvent(sampler->instance, &eventData);
+			if (res == XR_SUCCESS)
+			{
+				if (eventData.type == XR_TYPE_EVENT_DATA_INSTANCE_LOSS_PENDING)
+				{
+					printf("Instance is getting lost, bailing\n");
+					sampler_stop(sampler, SESSION_END_EXIT);
+				}
+				else if (	eventData.type == XR_TYPE_EVENT_DATA_SESSION_STATE_CHANGED &&
+						((XrEventDataSessionStateChanged*) &eventData)->session == sampler->session	)
+				{
+					const XrEventDataSessionStateChanged *changed =
+						(XrEventDataSessionStateChanged*) &eventData;
+
+					/* Don't make the sampler wait out its idle period */
+					if (changed->state == XR_SESSION_STATE_FOCUSED)
+					{
+						sem_post(&sampler->resume);
+					}
+
+					/* main takes it from here, see the lifecycle loop */
+					if (changed->state == XR_SESSION_STATE_STOPPING)
+					{
+						printf("Session is stopping\n");
+						sampler_stop(sampler, SESSION_END_STOPPING);
+					}
+					else if (changed->state == XR_SESSION_STATE_LOSS_PENDING)
+					{
+						printf("Session is getting lost, reconnecting\n");
+						sampler_stop(sampler, SESSION_END_LOST);
+					}
+					else if (changed->state == XR_SESSION_STATE_EXITING)
+					{
+						printf("Session is exiting, bailing\n");
+						sampler_stop(sampler, SESSION_END_EXIT);
+					}
+				}
+			}
+			else if (res != XR_EVENT_UNAVAILABLE)
+			{
+				xrResultToString(sampler->instance, res, resString);
+				printf("xrPollEvent: %s\n", resString);
+				sampler_stop(sampler, SESSION_END_ERROR);
+			}
+		}
+
+		service_messages(sampler, calibrationKey, trace);
+
+		if (statsRequested)
+		{
+			statsRequested = 0;
+			stats_report(&sampler->stats, stdout);
+			fflush(stdout);
+		}
+
+		control_service(control, sampler);
+
+		/* Nothing else here is latency sensitive, only a kick wakes us early */
+		clock_gettime(CLOCK_REALTIME, &wait);
+		timespec_add_ns(&wait, 10000000); /* 10ms */
+		while (sem_timedwait(&sampler->wake, &wait) == -1 && errno == EINTR);
+	}
+}
+
+/* Runs a --replay from start to finish, with no OpenXR involved */
+static int run_replay(
+	const Options *opts,
+	Sampler *sampler,
+	const int *fds,
+	Control *control
+) {
+	FILE *noTrace = NULL;
+	pthread_t samplerThread;
+	Trace trace;
+	int err, i;
+
+	if (!trace_open(opts->replayPath, &trace))
+	{
+		return -9;
+	}
+
+	memcpy(sampler->fds, fds, sizeof(sampler->fds));
+	sampler->replay = &trace;
+
+	/* The targets come from the command line, so the screens have to match */
+	if (trace.header->screenCount != (uint32_t) sampler->screens.count)
+	{
+		printf(
+			"%s has %u screens, replay it with --screens %u\n",
+			opts->replayPath,
+			trace.header->screenCount,
+			trace.header->screenCount
+		);
+		trace_close(&trace);
+		return -9;
+	}
+
+	sampler->state = RECORDING;
+	for (i = 0; i < sampler->screens.count; i += 1)
+	{
+		ScreenRect *rect = &sampler->screens.rects[i];
+		rect->cornerCount = trace.header->cornerCount;
+		if (!trace.header->calibrated)
+		{
+			continue;
+		}
+		memcpy(rect->corners, trace.header->corners[i], sizeof(rect->corners));
+		if (!screen_rect_calibrate(rect))
+		{
+			printf("%s has a bad calibration\n", opts->replayPath);
+			trace_close(&trace);
+			return -9;
+		}
+	}
+	if (trace.header->calibrated)
+	{
+		screens_prepare(&sampler->screens);
+		sampler->state = PLAYING;
+	}
+
+	printf("Replaying %zu samples from %s\n", trace.count, opts->replayPath);
+
+	err = sampler_thread_start(&samplerThread, sampler);
+	if (err != 0)
+	{
+		printf("Could not start sampler thread: %s\n", strerror(err));
+		trace_close(&trace);
+		return -9;
+	}
+	service_run(sampler, NULL, &noTrace, control);
+	pthread_join(samplerThread, NULL);
+	service_messages(sampler, NULL, &noTrace);
+
+	/* Replays are mostly for profiling, so always show the numbers */
+	stats_report(&sampler->stats, stdout);
+
+	trace_close(&trace);
+	return sampler->returnCode;
+}
+
+/* Session lifecycle.
+ *
+ * Only the session and its spaces have to be rebuilt when the session is lost.
+ * The instance, actions, bindings, uinput devices and calibration all outlive
+ * it, so reconnecting takes milliseconds instead of a process restart.
+ */
+typedef struct Session
+{
+	XrSession session;
+	XrSpace baseSpace;
+	XrSpace aimSpaces[MAX_GUNS];
+} Session;
+
+static void session_destroy(Session *session, int guns)
+{
+	int gun;
+
+	for (gun = 0; gun < guns; gun += 1)
+	{
+		xrDestroySpace(session->aimSpaces[gun]);
+		session->aimSpaces[gun] = XR_NULL_HANDLE;
+	}
+	xrDestroySpace(session->baseSpace);
+	session->baseSpace = XR_NULL_HANDLE;
+	xrDestroySession(session->session);
+	session->session = XR_NULL_HANDLE;
+}
+
+/* Creates the session, attaches the actions and creates the stage/aim spaces.
+ * On failure, *failed is the name of the function that failed and everything
+ * is cleaned up again.
+ */
+static XrResult session_create(
+	XrInstance instance,
+	XrSystemId systemID,
+	XrActionSet actionSet,
+	XrAction aim,
+	const XrPath *handPaths,
+	int guns,
+	Session *session,
+	const char **failed
+) {
+	XrSessionCreateInfo sessionCreateInfo;
+	XrSessionActionSetsAttachInfo attachInfo;
+	XrReferenceSpaceCreateInfo baseSpaceCreateInfo;
+	XrActionSpaceCreateInfo spaceCreateInfo;
+	XrResult res;
+	int gun;
+
+	memset(session, '\0', sizeof(Session));
+
+	#define SESSION_CHECK_ERROR(name) \
+		if (res != XR_SUCCESS) \
+		{ \
+			*failed = #name; \
+			session_destroy(session, guns); \
+			return res; \
+		}
+
+	sessionCreateInfo.type = XR_TYPE_SESSION_CREATE_INFO;
+	sessionCreateInfo.next = NULL; /* XR_MND_headless enables this to be NULL */
+	sessionCreateInfo.createFlags = 0;
+	sessionCreateInfo.systemId = systemID;
+
+	res = xrCreateSession(instance, &sessionCreateInfo, &session->session);
+	SESSION_CHECK_ERROR(xrCreateSession)
+
+	attachInfo.type = XR_TYPE_SESSION_ACTION_SETS_ATTACH_INFO;
+	attachInfo.next = NULL;
+	attachInfo.countActionSets = 1;
+	attachInfo.actionSets = &actionSet;
+
+	res = xrAttachSessionActionSets(session->session, &attachInfo);
+	SESSION_CHECK_ERROR(xrAttachSessionActionSets)
+
+	/* Set up position/rotation tracking */
+
+	baseSpaceCreateInfo.type = XR_TYPE_REFERENCE_SPACE_CREATE_INFO;
+	baseSpaceCreateInfo.next = NULL;
+	baseSpaceCreateInfo.referenceSpaceType = XR_REFERENCE_SPACE_TYPE_STAGE;
+	baseSpaceCreateInfo.poseInReferenceSpace.orientation.x = 0;
+	baseSpaceCreateInfo.poseInReferenceSpace.orientation.y = 0;
+	baseSpaceCreateInfo.poseInReferenceSpace.orientation.z = 0;
+	baseSpaceCreateInfo.poseInReferenceSpace.orientation.w = 1;
+	baseSpaceCreateInfo.poseInReferenceSpace.position.x = 0;
+	baseSpaceCreateInfo.poseInReferenceSpace.position.y = 0;
+	baseSpaceCreateInfo.poseInReferenceSpace.position.z = 0;
+
+	res = xrCreateReferenceSpace(session->session, &baseSpaceCreateInfo, &session->baseSpace);
+	SESSION_CHECK_ERROR(xrCreateReferenceSpace)
+
+	spaceCreateInfo.type = XR_TYPE_ACTION_SPACE_CREATE_INFO;
+	spaceCreateInfo.next = NULL;
+	spaceCreateInfo.action = aim;
+	spaceCreateInfo.poseInActionSpace.orientation.x = 0;
+	spaceCreateInfo.poseInActionSpace.orientation.y = 0;
+	spaceCreateInfo.poseInActionSpace.orientation.z = 0;
+	spaceCreateInfo.poseInActionSpace.orientation.w = 1;
+	spaceCreateInfo.poseInActionSpace.position.x = 0;
+	spaceCreateInfo.poseInActionSpace.position.y = 0;
+	spaceCreateInfo.poseInActionSpace.position.z = 0;
+
+	for (gun = 0; gun < guns; gun += 1)
+	{
+		spaceCreateInfo.subactionPath = handPaths[gun];
+		res = xrCreateActionSpace(session->session, &spaceCreateInfo, &session->aimSpaces[gun]);
+		SESSION_CHECK_ERROR(xrCreateActionSpace)
+	}
+
+	#undef SESSION_CHECK_ERROR
+	return XR_SUCCESS;
+}
+
+/* Polls events until the session needs something from us: READY to begin it,
+ * STOPPING to end it, or LOSS_PENDING/EXITING. Returns XR_SESSION_STATE_UNKNOWN
+ * if the instance is going away or polling fails.
+ *
+ * There's no blocking xrPollEvent, so this sleeps between polls, backing off
+ * like an idle sampler does: READY usually shows up within the first few
+ * short sleeps, and if it doesn't, we're only polling every
+ * MAX_IDLE_PERIOD_NS.
+ */
+
+static XrSessionState session_wait(XrInstance instance, XrSession session, int pollRate)
+{
+	XrEventDataBuffer eventData;
+	char resString[XR_MAX_RESULT_STRING_SIZE];
+	XrResult res;
+	Pacer pacer;
+
+	pacer_init(&pacer, pollRate, NULL);
+	for (;;)
+	{
+		eventData.type = XR_TYPE_EVENT_DATA_BUFFER;
+		eventData.next = NULL;
+
+		res = xrPollEvent(instance, &eventData);
+		if (res == XR_EVENT_UNAVAILABLE)
+		{
+			pacer_wait(&pacer, 0);
+			continue;
+		}
+		if (res != XR_SUCCESS)
+		{
+			xrResultToString(instance, res, resString);
+			printf("xrPollEvent: %s\n", resString);
+			return XR_SESSION_STATE_UNKNOWN;
+		}
+
+		if (eventData.type == XR_TYPE_EVENT_DATA_INSTANCE_LOSS_PENDING)
+		{
+			printf("Instance is getting lost, bailing\n");
+			return XR_SESSION_STATE_UNKNOWN;
+		}
+		if (eventData.type == XR_TYPE_EVENT_DATA_SESSION_STATE_CHANGED)
+		{
+			const XrEventDataSessionStateChanged *changed =
+				(XrEventDataSessionStateChanged*) &eventData;
+
+			/* Stragglers from a session we already threw out */
+			if (changed->session != session)
+			{
+				continue;
+			}
+			if (	changed->state == XR_SESSION_STATE_READY ||
+				changed->state == XR_SESSION_STATE_STOPPING ||
+				changed->state == XR_SESSION_STATE_LOSS_PENDING ||
+				changed->state == XR_SESSION_STATE_EXITING	)
+			{
+				return changed->state;
+			}
+		}
+	}
+}
+
+/* Returns 1 if the runtime offers the named instance extension. The only
+ * optional one is XR_KHR_locate_spaces so far, see main.
+ */
+#ifdef XR_KHR_locate_spaces
+static int instance_extension_available(const char *name)
+{
+	XrExtensionProperties *properties;
+	uint32_t count, i;
+	int found = 0;
+
+	if (	xrEnumerateInstanceExtensionProperties(NULL, 0, &count, NULL) != XR_SUCCESS ||
+		count == 0	)
+	{
+		return 0;
+	}
+	properties = (XrExtensionProperties*) malloc(count * sizeof(XrExtensionProperties));
+	if (properties == NULL)
+	{
+		return 0;
+	}
+	for (i = 0; i < count; i += 1)
+	{
+		properties[i].type = XR_TYPE_EXTENSION_PROPERTIES;
+		properties[i].next = NULL;
+	}
+	if (xrEnumerateInstanceExtensionProperties(NULL, count, &count, properties) == XR_SUCCESS)
+	{
+		for (i = 0; i < count; i += 1)
+		{
+			if (strcmp(properties[i].extensionName, name) == 0)
+			{
+				found = 1;
+				break;
+			}
+		}
+	}
+	free(properties);
+	return found;
+}
+#endif
+
+/* Setup asks for the same paths over and over (every profile binds the same
+ * hands, and a lot of the same inputs), so each string only goes to
+ * xrStringToPath once. The table is only used during setup.
+ */
+#define MAX_CACHED_PATHS 128
 
-	/* Add length of side B to pose->position, normalize result */
-	float resultX = ((pose->position.x - offX) - x0) / (x1 - x0);
-	float resultY = ((pose->position.y + offY) - y0) / (y1 - y0);
+typedef struct PathCache
+{
+	int count;
+	XrPath paths[MAX_CACHED_PATHS];
+	char strings[MAX_CACHED_PATHS][XR_MAX_PATH_LENGTH];
+} PathCache;
+
+static XrResult path_cache_get(
+	XrInstance instance,
+	PathCache *cache,
+	const char *string,
+	XrPath *path
+) {
+	XrResult res;
+	int i;
 
-	if (resultX < 0 || resultX > 1 || resultY < 0 || resultY > 1)
+	for (i = 0; i < cache->count; i += 1)
 	{
-		return 0;
+		if (strcmp(cache->strings[i], string) == 0)
+		{
+			*path = cache->paths[i];
+			return XR_SUCCESS;
+		}
 	}
-	if ((resultX != *mouseX) || (resultY != *mouseY))
+	res = xrStringToPath(instance, string, path);
+	if (res == XR_SUCCESS && cache->count < MAX_CACHED_PATHS && strlen(string) < XR_MAX_PATH_LENGTH)
 	{
-		*mouseX = resultX;
-		*mouseY = resultY;
-		return 1;
+		strcpy(cache->strings[cache->count], string);
+		cache->paths[cache->count] = *path;
+		cache->count += 1;
 	}
-	return 0;
+	return res;
 }
 
+/* bench.c includes this file directly to get at the static functions above */
+#ifndef LIGHTGUNXR_NO_MAIN
+
 int main(int argc, char **argv)
 {
 	/* "Global" variables */
@@ -142,80 +5602,132 @@ int main(int argc, char **argv)
 	XrActionSet actionSet = 0;
 	XrAction
 		aim = 0,
-		fire = 0,
-		pedal = 0,
-		pause = 0,
 		kickback = 0;
-	XrSession session = 0;
-	XrSpace baseSpace = 0, aimSpace = 0;
+	XrAction buttons[MAX_BUTTONS];
+	XrPath handPaths[MAX_GUNS];
+	Session session;
+	Sampler sampler;
+	Control control;
+	pthread_t samplerThread;
+	int samplerStarted = 0;
+	FILE *trace = NULL;
+	uint64_t lostTime = 0;
+	int gun, button;
+
+	memset(buttons, '\0', sizeof(buttons));
+	memset(&session, '\0', sizeof(session));
 
 	/* Error handling */
 
 	XrResult res;
 	char resString[XR_MAX_RESULT_STRING_SIZE];
 
-	/* Platform setup */
-
-#ifdef __linux__
-	struct uinput_setup usetup;
-	struct uinput_abs_setup abssetup;
-	struct input_event ie;
+	/* Command line */
 
-	int fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
-	if (fd == -1)
+	Options opts;
+	if (!parse_options(argc, argv, &opts))
 	{
-		printf("uinput could not be opened\n");
-		return errno;
+		return 1;
 	}
 
-	ioctl(fd, UI_SET_EVBIT, EV_KEY);
-	ioctl(fd, UI_SET_KEYBIT, KEY_Z);
-	ioctl(fd, UI_SET_KEYBIT, KEY_X);
-	ioctl(fd, UI_SET_KEYBIT, KEY_C);
-	ioctl(fd, UI_SET_KEYBIT, BTN_LEFT);
+	/* Installed before anything can block, so a report request during
+	 * startup or a reconnect doesn't kill the process
+	 */
+	signal(SIGUSR1, on_sigusr1);
 
-	ioctl(fd, UI_SET_EVBIT, EV_ABS);
-	ioctl(fd, UI_SET_ABSBIT, ABS_X);
-	ioctl(fd, UI_SET_ABSBIT, ABS_Y);
+	sampler_init(&sampler, &opts);
+	if (!control_open(&control, opts.controlPath))
+	{
+		sampler_destroy(&sampler);
+		return 1;
+	}
 
-	ioctl(fd, UI_SET_EVBIT, EV_SYN);
+	/* Platform setup */
 
-	memset(&usetup, '\0', sizeof(usetup));
-	usetup.id.bustype = BUS_USB;
-	usetup.id.vendor = 0x0420;
-	usetup.id.product = 0x6969;
-	strncpy(usetup.name, "Light Gun XR", sizeof(usetup.name));
-	ioctl(fd, UI_DEV_SETUP, &usetup);
+#ifdef __linux__
+	int fds[MAX_GUNS];
+	int keys[MAX_BUTTONS + 1];
+	int keyCount = 0;
 
-	abssetup.absinfo.value = 0;
-	abssetup.absinfo.minimum = 0;
-	abssetup.absinfo.fuzz = 0;
-	abssetup.absinfo.flat = 0;
-	abssetup.absinfo.resolution = 0;
+	for (button = 0; button < opts.buttonCount; button += 1)
+	{
+		keys[keyCount++] = opts.buttons[button].key;
+	}
+	if (opts.offscreen & OFFSCREEN_RELOAD)
+	{
+		keys[keyCount++] = opts.reloadKey;
+	}
+	for (gun = 0; gun < opts.guns; gun += 1)
+	{
+		fds[gun] = uinput_create(
+			gun,
+			keys,
+			keyCount,
+			opts.axisMaxX,
+			opts.axisMaxY
+		);
+		if (fds[gun] != -1)
+		{
+			continue;
+		}
+		if (opts.replayPath == NULL)
+		{
+			const int err = errno;
+			printf("uinput could not be opened\n");
+			while (gun-- > 0)
+			{
+				uinput_destroy(fds[gun]);
+			}
+			control_close(&control);
+			sampler_destroy(&sampler);
+			return err;
+		}
 
-	abssetup.code = ABS_X;
-	abssetup.absinfo.maximum = SCREEN_WIDTH;
-	ioctl(fd, UI_ABS_SETUP, &abssetup);
-	abssetup.code = ABS_Y;
-	abssetup.absinfo.maximum = SCREEN_HEIGHT;
-	ioctl(fd, UI_ABS_SETUP, &abssetup);
+		/* Replays can still run the whole pipeline without uinput */
+		printf("uinput could not be opened, replaying to /dev/null\n");
+		fds[gun] = open("/dev/null", O_WRONLY);
+	}
+#endif
 
-	ioctl(fd, UI_DEV_CREATE);
+	/* Trace replay doesn't need OpenXR at all */
 
-	ie.time.tv_sec = 0;
-	ie.time.tv_usec = 0;
+	if (opts.replayPath != NULL)
+	{
+		const int replayResult = run_replay(&opts, &sampler, fds, &control);
+		control_close(&control);
+		sampler_destroy(&sampler);
+#ifdef __linux__
+		for (gun = 0; gun < opts.guns; gun += 1)
+		{
+			uinput_destroy(fds[gun]);
+		}
 #endif
+		return replayResult;
+	}
 
 	/* Instance creation */
 
 	XrInstanceCreateInfo instanceCreateInfo;
-	const char *extensions[] =
+	const char *extensions[3] =
 	{
 		XR_MND_HEADLESS_EXTENSION_NAME,
 		XR_KHR_CONVERT_TIMESPEC_TIME_EXTENSION_NAME
 	};
+	uint32_t extensionCount = 2;
 	PFN_xrConvertTimespecTimeToTimeKHR pxrConvertTimespecTimeToTimeKHR;
 
+	/* Optional, lets us locate every gun with one call. It's only in the
+	 * OpenXR 1.0.34 headers and up, older ones get the xrLocateSpace loop.
+	 */
+#ifdef XR_KHR_locate_spaces
+	PFN_xrLocateSpacesKHR pxrLocateSpacesKHR = NULL;
+	const int locateSpaces = instance_extension_available(XR_KHR_LOCATE_SPACES_EXTENSION_NAME);
+	if (locateSpaces)
+	{
+		extensions[extensionCount++] = XR_KHR_LOCATE_SPACES_EXTENSION_NAME;
+	}
+#endif
+
 	instanceCreateInfo.type = XR_TYPE_INSTANCE_CREATE_INFO;
 	instanceCreateInfo.next = NULL;
 	instanceCreateInfo.createFlags = 0;
@@ -226,7 +5738,7 @@ int main(int argc, char **argv)
 	instanceCreateInfo.applicationInfo.apiVersion = XR_MAKE_VERSION(1, 0, 0);
 	instanceCreateInfo.enabledApiLayerCount = 0;
 	instanceCreateInfo.enabledApiLayerNames = NULL;
-	instanceCreateInfo.enabledExtensionCount = 2;
+	instanceCreateInfo.enabledExtensionCount = extensionCount;
 	instanceCreateInfo.enabledExtensionNames = extensions;
 
 	res = xrCreateInstance(&instanceCreateInfo, &instance);
@@ -250,6 +5762,8 @@ int main(int argc, char **argv)
 			default: strncpy(resString, "UNKNOWN", sizeof(resString)); break;
 		}
 		printf("xrCreateInstance: %s\n", resString);
+		control_close(&control);
+		sampler_destroy(&sampler);
 		return -1;
 	}
 
@@ -274,6 +5788,18 @@ int main(int argc, char **argv)
 	);
 	CHECK_ERROR(xrGetInstanceProcAddr)
 
+#ifdef XR_KHR_locate_spaces
+	if (locateSpaces)
+	{
+		res = xrGetInstanceProcAddr(
+			instance,
+			"xrLocateSpacesKHR",
+			(PFN_xrVoidFunction*) &pxrLocateSpacesKHR
+		);
+		CHECK_ERROR(xrGetInstanceProcAddr)
+	}
+#endif
+
 	/* Action set */
 
 	returnCode = -3;
@@ -290,10 +5816,26 @@ int main(int argc, char **argv)
 	res = xrCreateActionSet(instance, &actionsetCreateInfo, &actionSet);
 	CHECK_ERROR(xrCreateActionSet)
 
+	/* Player 1 is the right hand, player 2 the left */
+	static const char *gunHands[MAX_GUNS] =
+	{
+		"right",
+		"left"
+	};
+	PathCache pathCache;
+	pathCache.count = 0;
+	for (gun = 0; gun < opts.guns; gun += 1)
+	{
+		char handPath[XR_MAX_PATH_LENGTH];
+		snprintf(handPath, sizeof(handPath), "/user/hand/%s", gunHands[gun]);
+		res = path_cache_get(instance, &pathCache, handPath, &handPaths[gun]);
+		CHECK_ERROR(xrStringToPath)
+	}
+
 	actionCreateInfo.type = XR_TYPE_ACTION_CREATE_INFO;
 	actionCreateInfo.next = NULL;
-	actionCreateInfo.countSubactionPaths = 0;
-	actionCreateInfo.subactionPaths = NULL;
+	actionCreateInfo.countSubactionPaths = opts.guns;
+	actionCreateInfo.subactionPaths = handPaths;
 
 	#define SETUP_ACTION(name, localized, type) \
 		strncpy(actionCreateInfo.actionName, #name, XR_MAX_ACTION_NAME_SIZE); \
@@ -303,56 +5845,82 @@ int main(int argc, char **argv)
 		CHECK_ERROR(xrCreateAction)
 
 	SETUP_ACTION(aim, "Aim", XR_ACTION_TYPE_POSE_INPUT)
-	SETUP_ACTION(fire, "Fire", XR_ACTION_TYPE_BOOLEAN_INPUT)
-	SETUP_ACTION(pedal, "Pedal", XR_ACTION_TYPE_BOOLEAN_INPUT)
-	SETUP_ACTION(pause, "Pause", XR_ACTION_TYPE_BOOLEAN_INPUT)
 	SETUP_ACTION(kickback, "Kickback", XR_ACTION_TYPE_VIBRATION_OUTPUT)
 
 	#undef SETUP_ACTION
 
-	/* Bind to Valve Index */
-
-	returnCode = -4;
-
-	XrPath indexPath;
-	XrActionSuggestedBinding indexBindings[6];
-	XrInteractionProfileSuggestedBinding indexBindingCreateInfo;
+	actionCreateInfo.actionType = XR_ACTION_TYPE_BOOLEAN_INPUT;
+	for (button = 0; button < opts.buttonCount; button += 1)
+	{
+		strncpy(actionCreateInfo.actionName, opts.buttons[button].name, XR_MAX_ACTION_NAME_SIZE);
+		strncpy(
+			actionCreateInfo.localizedActionName,
+			opts.buttons[button].label,
+			XR_MAX_LOCALIZED_ACTION_NAME_SIZE
+		);
+		res = xrCreateAction(actionSet, &actionCreateInfo, &buttons[button]);
+		CHECK_ERROR(xrCreateAction)
+	}
 
-	res = xrStringToPath(instance, "/interaction_profiles/valve/index_controller", &indexPath);
-	CHECK_ERROR(xrStringToPath)
+	/* Bindings, for every profile we know of */
 
-	indexBindings[0].action = aim;
-	res = xrStringToPath(instance, "/user/hand/right/input/aim/pose", &indexBindings[0].binding);
-	CHECK_ERROR(xrStringToPath)
+	returnCode = -4;
 
-	indexBindings[1].action = fire;
-	res = xrStringToPath(instance, "/user/hand/right/input/trigger/click", &indexBindings[1].binding);
-	CHECK_ERROR(xrStringToPath)
+	XrPath profilePath;
+	XrActionSuggestedBinding bindings[(2 + (MAX_BUTTONS * MAX_BUTTON_PATHS)) * MAX_GUNS];
+	XrInteractionProfileSuggestedBinding bindingCreateInfo;
+	char bindingPath[XR_MAX_PATH_LENGTH];
+	uint32_t bindingCount;
+	int profile;
 
-	indexBindings[2].action = pedal;
-	res = xrStringToPath(instance, "/user/hand/right/input/a/click", &indexBindings[2].binding);
-	CHECK_ERROR(xrStringToPath)
+	#define SUGGEST_BINDING(name, path) \
+		snprintf(bindingPath, sizeof(bindingPath), "/user/hand/%s%s", gunHands[gun], path); \
+		bindings[bindingCount].action = name; \
+		res = path_cache_get(instance, &pathCache, bindingPath, &bindings[bindingCount].binding); \
+		CHECK_ERROR(xrStringToPath) \
+		bindingCount += 1;
 
-	indexBindings[3].action = pedal;
-	res = xrStringToPath(instance, "/user/hand/right/input/b/click", &indexBindings[3].binding);
-	CHECK_ERROR(xrStringToPath)
+	for (profile = 0; profile < PROFILE_COUNT; profile += 1)
+	{
+		res = path_cache_get(instance, &pathCache, interactionProfiles[profile].path, &profilePath);
+		CHECK_ERROR(xrStringToPath)
 
-	indexBindings[4].action = pause;
-	res = xrStringToPath(instance, "/user/hand/right/input/thumbstick/click", &indexBindings[4].binding);
-	CHECK_ERROR(xrStringToPath)
+		bindingCount = 0;
+		for (gun = 0; gun < opts.guns; gun += 1)
+		{
+			SUGGEST_BINDING(aim, "/input/aim/pose")
+			SUGGEST_BINDING(kickback, "/output/haptic")
+			for (button = 0; button < opts.buttonCount; button += 1)
+			{
+				int path;
+				for (path = 0; path < opts.buttons[button].pathCount; path += 1)
+				{
+					if (opts.buttons[button].pathProfiles[path] == profile)
+					{
+						SUGGEST_BINDING(buttons[button], opts.buttons[button].paths[path])
+					}
+				}
+			}
+		}
 
-	indexBindings[5].action = kickback;
-	res = xrStringToPath(instance, "/user/hand/right/output/haptic", &indexBindings[5].binding);
-	CHECK_ERROR(xrStringToPath)
+		bindingCreateInfo.type = XR_TYPE_INTERACTION_PROFILE_SUGGESTED_BINDING;
+		bindingCreateInfo.next = NULL;
+		bindingCreateInfo.interactionProfile = profilePath;
+		bindingCreateInfo.countSuggestedBindings = bindingCount;
+		bindingCreateInfo.suggestedBindings = bindings;
 
-	indexBindingCreateInfo.type = XR_TYPE_INTERACTION_PROFILE_SUGGESTED_BINDING;
-	indexBindingCreateInfo.next = NULL;
-	indexBindingCreateInfo.interactionProfile = indexPath;
-	indexBindingCreateInfo.countSuggestedBindings = 6;
-	indexBindingCreateInfo.suggestedBindings = indexBindings;
+		/* The Index is the one we can't do without, the rest are extras */
+		res = xrSuggestInteractionProfileBindings(instance, &bindingCreateInfo);
+		if (res != XR_SUCCESS && profile != 0)
+		{
+			xrResultToString(instance, res, resString);
+			printf("Skipping %s bindings: %s\n", interactionProfiles[profile].name, resString);
+			continue;
+		}
+		CHECK_ERROR(xrSuggestInteractionProfileBindings)
+	}
 
-	res = xrSuggestInteractionProfileBindings(instance, &indexBindingCreateInfo);
-	CHECK_ERROR(xrSuggestInteractionProfileBindings)
+	#undef SUGGEST_BINDING
 
 	/* Session creation */
 
@@ -360,8 +5928,7 @@ int main(int argc, char **argv)
 
 	XrSystemId systemID;
 	XrSystemGetInfo systemGetInfo;
-	XrSessionCreateInfo sessionCreateInfo;
-	XrSessionActionSetsAttachInfo attachInfo;
+	const char *failedFunction;
 
 	systemGetInfo.type = XR_TYPE_SYSTEM_GET_INFO;
 	systemGetInfo.next = NULL;
@@ -370,287 +5937,276 @@ int main(int argc, char **argv)
 	res = xrGetSystem(instance, &systemGetInfo, &systemID);
 	CHECK_ERROR(xrGetSystem)
 
-	sessionCreateInfo.type = XR_TYPE_SESSION_CREATE_INFO;
-	sessionCreateInfo.next = NULL; /* XR_MND_headless enables this to be NULL */
-	sessionCreateInfo.createFlags = 0;
-	sessionCreateInfo.systemId = systemID;
-
-	res = xrCreateSession(instance, &sessionCreateInfo, &session);
-	CHECK_ERROR(xrCreateSession)
-
-	attachInfo.type = XR_TYPE_SESSION_ACTION_SETS_ATTACH_INFO;
-	attachInfo.next = NULL;
-	attachInfo.countActionSets = 1;
-	attachInfo.actionSets = &actionSet;
-
-	res = xrAttachSessionActionSets(session, &attachInfo);
-	CHECK_ERROR(xrAttachSessionActionSets)
-
-	/* Set up position/rotation tracking */
-
 	returnCode = -6;
 
-	XrReferenceSpaceCreateInfo baseSpaceCreateInfo;
-	XrActionSpaceCreateInfo spaceCreateInfo;
+	res = session_create(
+		instance,
+		systemID,
+		actionSet,
+		aim,
+		handPaths,
+		opts.guns,
+		&session,
+		&failedFunction
+	);
+	if (res != XR_SUCCESS)
+	{
+		xrResultToString(instance, res, resString);
+		printf("%s: %s\n", failedFunction, resString);
+		goto cleanup;
+	}
 
-	baseSpaceCreateInfo.type = XR_TYPE_REFERENCE_SPACE_CREATE_INFO;
-	baseSpaceCreateInfo.next = NULL;
-	baseSpaceCreateInfo.referenceSpaceType = XR_REFERENCE_SPACE_TYPE_STAGE;
-	baseSpaceCreateInfo.poseInReferenceSpace.orientation.x = 0;
-	baseSpaceCreateInfo.poseInReferenceSpace.orientation.y = 0;
-	baseSpaceCreateInfo.poseInReferenceSpace.orientation.z = 0;
-	baseSpaceCreateInfo.poseInReferenceSpace.orientation.w = 1;
-	baseSpaceCreateInfo.poseInReferenceSpace.position.x = 0;
-	baseSpaceCreateInfo.poseInReferenceSpace.position.y = 0;
-	baseSpaceCreateInfo.poseInReferenceSpace.position.z = 0;
+	/* Identify the runtime/stage for the calibration cache */
 
-	res = xrCreateReferenceSpace(session, &baseSpaceCreateInfo, &baseSpace);
-	CHECK_ERROR(xrCreateReferenceSpace)
+	CalibrationKey calibrationKey;
+	XrInstanceProperties instanceProperties;
+	XrSystemProperties systemProperties;
 
+	memset(&calibrationKey, '\0', sizeof(calibrationKey));
 
-	spaceCreateInfo.type = XR_TYPE_ACTION_SPACE_CREATE_INFO;
-	spaceCreateInfo.next = NULL;
-	spaceCreateInfo.action = aim;
-	spaceCreateInfo.subactionPath = XR_NULL_PATH;
-	spaceCreateInfo.poseInActionSpace.orientation.x = 0;
-	spaceCreateInfo.poseInActionSpace.orientation.y = 0;
-	spaceCreateInfo.poseInActionSpace.orientation.z = 0;
-	spaceCreateInfo.poseInActionSpace.orientation.w = 1;
-	spaceCreateInfo.poseInActionSpace.position.x = 0;
-	spaceCreateInfo.poseInActionSpace.position.y = 0;
-	spaceCreateInfo.poseInActionSpace.position.z = 0;
+	instanceProperties.type = XR_TYPE_INSTANCE_PROPERTIES;
+	instanceProperties.next = NULL;
+	res = xrGetInstanceProperties(instance, &instanceProperties);
+	CHECK_ERROR(xrGetInstanceProperties)
+	strncpy(calibrationKey.runtimeName, instanceProperties.runtimeName, XR_MAX_RUNTIME_NAME_SIZE - 1);
+	calibrationKey.runtimeVersion = instanceProperties.runtimeVersion;
+
+	systemProperties.type = XR_TYPE_SYSTEM_PROPERTIES;
+	systemProperties.next = NULL;
+	res = xrGetSystemProperties(instance, systemID, &systemProperties);
+	CHECK_ERROR(xrGetSystemProperties)
+	strncpy(calibrationKey.systemName, systemProperties.systemName, XR_MAX_SYSTEM_NAME_SIZE - 1);
+	calibrationKey.vendorId = systemProperties.vendorId;
 
-	res = xrCreateActionSpace(session, &spaceCreateInfo, &aimSpace);
-	CHECK_ERROR(xrCreateActionSpace)
+	/* XR_SPACE_BOUNDS_UNAVAILABLE is fine, the bounds are just left at 0 */
+	res = xrGetReferenceSpaceBoundsRect(
+		session.session,
+		XR_REFERENCE_SPACE_TYPE_STAGE,
+		&calibrationKey.stageBounds
+	);
+	if (res != XR_SPACE_BOUNDS_UNAVAILABLE)
+	{
+		CHECK_ERROR(xrGetReferenceSpaceBoundsRect)
+	}
+	else
+	{
+		calibrationKey.stageBounds.width = 0;
+		calibrationKey.stageBounds.height = 0;
+	}
 
-	/* Wait for the signal to begin the session */
+	/* Sampler setup, everything in here survives a reconnect */
 
 	returnCode = -7;
 
-	XrEventDataBuffer eventData;
-	XrSessionBeginInfo beginInfo;
+	sampler.instance = instance;
+	sampler.actionSet = actionSet;
+	memcpy(sampler.buttonActions, buttons, sizeof(buttons));
+	sampler.kickback = kickback;
+	memcpy(sampler.handPaths, handPaths, sizeof(handPaths));
+	sampler.pxrConvertTimespecTimeToTimeKHR = pxrConvertTimespecTimeToTimeKHR;
+#ifdef XR_KHR_locate_spaces
+	sampler.pxrLocateSpacesKHR = pxrLocateSpacesKHR;
+#endif
+	memcpy(sampler.fds, fds, sizeof(fds));
+	sampler.state = RECORDING;
 
-	do
+	if (	!opts.recalibrate &&
+		calibration_load(opts.calibrationPath, &calibrationKey, &sampler.screens)	)
 	{
-		eventData.type = XR_TYPE_EVENT_DATA_BUFFER;
-		eventData.next = NULL;
+		printf(
+			"Loaded %d-corner calibration from %s\n",
+			sampler.screens.rects[0].cornerCount,
+			opts.calibrationPath
+		);
+		screens_prepare(&sampler.screens);
+		sampler.state = PLAYING;
+	}
 
-		res = xrPollEvent(instance, &eventData);
-		CHECK_ERROR(xrPollEvent)
-	} while (eventData.type != XR_TYPE_EVENT_DATA_SESSION_STATE_CHANGED);
+	if (opts.tracePath != NULL)
+	{
+		trace = trace_create(opts.tracePath, &sampler.screens, sampler.state == PLAYING);
+		if (trace == NULL)
+		{
+			printf("%s could not be created: %s\n", opts.tracePath, strerror(errno));
+			goto cleanup;
+		}
+		printf("Recording trace to %s\n", opts.tracePath);
+	}
+
+	/* Session lifecycle, see session_create */
 
+	XrSessionBeginInfo beginInfo;
 	beginInfo.type = XR_TYPE_SESSION_BEGIN_INFO;
 	beginInfo.next = NULL;
 	beginInfo.primaryViewConfigurationType = 0; /* XR_MND_headless enables this to be 0 */
 
-	res = xrBeginSession(session, &beginInfo);
-	CHECK_ERROR(xrBeginSession)
-
-	/* Action polling, finally. */
-
-	returnCode = -8;
-
-	enum
+	for (;;)
 	{
-		RECORDING_TOPLEFT,
-		RECORDING_BOTTOMRIGHT,
-		PLAYING
-	} state = RECORDING_TOPLEFT;
-	float x0, x1, y0, y1, z;
-
-	int run = 1, sync = 0;
-	float mouseX = 0, mouseY = 0;
-	XrActiveActionSet activeSet;
-	XrActionsSyncInfo syncInfo;
-	XrActionStateGetInfo getInfo;
+		XrSessionState state;
+		SessionEnd end;
+		int threadError;
 
-	activeSet.actionSet = actionSet;
-	activeSet.subactionPath = XR_NULL_PATH;
+		if (session.session == XR_NULL_HANDLE)
+		{
+			Pacer reconnectPacer;
 
-	syncInfo.type = XR_TYPE_ACTIONS_SYNC_INFO;
-	syncInfo.next = NULL;
-	syncInfo.countActiveActionSets = 1;
-	syncInfo.activeActionSets = &activeSet;
+			returnCode = -5;
 
-	getInfo.type = XR_TYPE_ACTION_STATE_GET_INFO;
-	getInfo.next = NULL;
-	getInfo.subactionPath = XR_NULL_PATH;
+			/* The system may take a moment to come back */
+			pacer_init(&reconnectPacer, opts.pollRate, NULL);
+			while (	(res = xrGetSystem(instance, &systemGetInfo, &systemID)) ==
+				XR_ERROR_FORM_FACTOR_UNAVAILABLE	)
+			{
+				pacer_wait(&reconnectPacer, 0);
+			}
+			CHECK_ERROR(xrGetSystem)
 
-	printf("Light Gun XR has started!\n");
-	while (run)
-	{
-		res = xrSyncActions(session, &syncInfo);
-		if (res == XR_SUCCESS)
-		{
-			struct timespec clock;
-			XrTime time;
-			XrSpaceLocation aimState;
-			XrActionStateBoolean fireState, pedalState, pauseState;
+			returnCode = -6;
 
-			clock_gettime(CLOCK_MONOTONIC, &clock);
-			res = pxrConvertTimespecTimeToTimeKHR(
+			res = session_create(
 				instance,
-				&clock,
-				&time
+				systemID,
+				actionSet,
+				aim,
+				handPaths,
+				opts.guns,
+				&session,
+				&failedFunction
 			);
-			CHECK_ERROR(xrConvertTimespecTimeToTimeKHR)
-
-			aimState.type = XR_TYPE_SPACE_LOCATION;
-			aimState.next = NULL;
-			res = xrLocateSpace(aimSpace, baseSpace, time, &aimState);
-			CHECK_ERROR(xrLocateSpace)
-
-			getInfo.action = fire;
-			res = xrGetActionStateBoolean(session, &getInfo, &fireState);
-			CHECK_ERROR(xrGetActionStateBoolean)
+			if (res != XR_SUCCESS)
+			{
+				xrResultToString(instance, res, resString);
+				printf("%s: %s\n", failedFunction, resString);
+				goto cleanup;
+			}
+		}
 
-			getInfo.action = pedal;
-			res = xrGetActionStateBoolean(session, &getInfo, &pedalState);
-			CHECK_ERROR(xrGetActionStateBoolean)
+		/* Wait for the signal to begin the session */
 
-			getInfo.action = pause;
-			res = xrGetActionStateBoolean(session, &getInfo, &pauseState);
-			CHECK_ERROR(xrGetActionStateBoolean)
+		returnCode = -7;
 
-			if (state == RECORDING_TOPLEFT)
-			{
-				if (fireState.currentState && fireState.changedSinceLastSync)
-				{
-					x0 = aimState.pose.position.x;
-					y0 = aimState.pose.position.y;
-					z = aimState.pose.position.z;
-					state = RECORDING_BOTTOMRIGHT;
-					printf("Top left is (%.9f, %.9f, %.9f)\n", x0, y0, z);
-				}
-			}
-			else if (state == RECORDING_BOTTOMRIGHT)
+		state = session_wait(instance, session.session, opts.pollRate);
+		if (state == XR_SESSION_STATE_UNKNOWN)
+		{
+			goto cleanup;
+		}
+		else if (state == XR_SESSION_STATE_EXITING)
+		{
+			break;
+		}
+		else if (state == XR_SESSION_STATE_LOSS_PENDING)
+		{
+			printf("Session is getting lost, reconnecting\n");
+			if (lostTime == 0)
 			{
-				if (fireState.currentState && fireState.changedSinceLastSync)
-				{
-					x1 = aimState.pose.position.x;
-					y1 = aimState.pose.position.y;
-					z = (z < aimState.pose.position.z) ? z : aimState.pose.position.z;
-					state = PLAYING;
-					printf("Bottom right is (%.9f, %.9f, %.9f)\n", x1, y1, z);
-				}
+				lostTime = now_ns();
 			}
-			else
-			{
-				/* Quit */
-				if (fireState.currentState && pauseState.currentState)
-				{
-					run = 0;
-				}
+			session_destroy(&session, opts.guns);
+			continue;
+		}
+		else if (state == XR_SESSION_STATE_STOPPING)
+		{
+			xrEndSession(session.session);
+			continue;
+		}
 
-				/* Buttons */
-				if (fireState.changedSinceLastSync)
-				{
-					printf("Fire %s\n", fireState.currentState ? "Press" : "Release");
-#ifdef __linux__
-					ie.type = EV_KEY;
-					ie.code = BTN_LEFT;
-					ie.value = fireState.currentState;
-					write(fd, &ie, sizeof(ie));
-#endif
-					sync = 1;
-				}
-				if (pedalState.changedSinceLastSync)
-				{
-					printf("Pedal %s\n", pedalState.currentState ? "Press" : "Release");
-#ifdef __linux__
-					ie.type = EV_KEY;
-					ie.code = KEY_Z;
-					ie.value = pedalState.currentState;
-					write(fd, &ie, sizeof(ie));
-#endif
-					sync = 1;
-				}
-				if (pauseState.changedSinceLastSync)
-				{
-					printf("Pause %s\n", pauseState.currentState ? "Press" : "Release");
-#ifdef __linux__
-					ie.type = EV_KEY;
-					ie.code = KEY_C;
-					ie.value = pauseState.currentState;
-					write(fd, &ie, sizeof(ie));
-#endif
-					sync = 1;
-				}
+		res = xrBeginSession(session.session, &beginInfo);
+		CHECK_ERROR(xrBeginSession)
 
-				/* Pointer */
-				if (pose_to_pointer(
-					&aimState.pose,
-					x0,
-					x1,
-					y0,
-					y1,
-					z,
-					&mouseX,
-					&mouseY
-				)) {
-					printf(
-						"Pointer: %.9f, %.9f\n",
-						mouseX * SCREEN_WIDTH,
-						mouseY * SCREEN_HEIGHT
-					);
-#ifdef __linux__
-					ie.type = EV_ABS;
-					ie.code = ABS_X;
-					ie.value = (int) (mouseX * SCREEN_WIDTH);
-					write(fd, &ie, sizeof(ie));
-					ie.type = EV_ABS;
-					ie.code = ABS_Y;
-					ie.value = (int) (mouseY * SCREEN_HEIGHT);
-					write(fd, &ie, sizeof(ie));
-#endif
-					sync = 1;
-				}
+		/* Action polling, finally. */
 
-				if (sync)
-				{
-#ifdef __linux__
-					ie.type = EV_SYN;
-					ie.code = SYN_REPORT;
-					ie.value = 0;
-					write(fd, &ie, sizeof(ie));
-#endif
-					sync = 0;
-				}
+		returnCode = -8;
 
-				/* TODO: Haptic output */
-			}
+		sampler.session = session.session;
+		sampler.baseSpace = session.baseSpace;
+		memcpy(sampler.aimSpaces, session.aimSpaces, sizeof(session.aimSpaces));
+		atomic_store(&sampler.run, 1);
+		atomic_store(&sampler.end, SESSION_END_NONE);
+
+		threadError = sampler_thread_start(&samplerThread, &sampler);
+		if (threadError != 0)
+		{
+			printf("Could not start sampler thread: %s\n", strerror(threadError));
+			goto cleanup;
 		}
-		else if (res == XR_SESSION_LOSS_PENDING)
+		samplerStarted = 1;
+
+		if (lostTime == 0)
 		{
-			printf("Session is getting lost, bailing\n");
-			run = 0;
+			printf("Light Gun XR has started!\n");
 		}
-		else if (res != XR_SESSION_NOT_FOCUSED)
+		else
 		{
-			CHECK_ERROR(xrSyncActions)
+			printf("Reconnected in %.1f ms\n", (now_ns() - lostTime) / 1000000.0);
+			lostTime = 0;
 		}
+		service_run(&sampler, &calibrationKey, &trace, &control);
+		pthread_join(samplerThread, NULL);
+		samplerStarted = 0;
+		service_messages(&sampler, &calibrationKey, &trace);
 
-		/* Per XR_MND_headless, we need to throttle our event loop */
-		usleep(1000);
+		end = (SessionEnd) atomic_load(&sampler.end);
+		if (end == SESSION_END_STOPPING)
+		{
+			/* Might get READY again, then we just begin again */
+			xrEndSession(session.session);
+		}
+		else if (end == SESSION_END_LOST)
+		{
+			lostTime = now_ns();
+			session_destroy(&session, opts.guns);
+		}
+		else if (end == SESSION_END_ERROR)
+		{
+			returnCode = (sampler.returnCode != 0) ? sampler.returnCode : -8;
+			goto cleanup;
+		}
+		else
+		{
+			/* Quit or exit */
+			break;
+		}
+	}
+
+	if (opts.latencyTest > 0)
+	{
+		stats_report(&sampler.stats, stdout);
 	}
 
 	/* Clean up. We out. */
 	returnCode = 0;
 cleanup:
+	if (samplerStarted)
+	{
+		atomic_store(&sampler.run, 0);
+		pthread_join(samplerThread, NULL);
+	}
+	if (trace != NULL)
+	{
+		fclose(trace);
+	}
 #ifdef __linux__
-	ioctl(fd, UI_DEV_DESTROY);
-	close(fd);
+	for (gun = 0; gun < opts.guns; gun += 1)
+	{
+		uinput_destroy(fds[gun]);
+	}
 #endif
-	xrDestroySpace(aimSpace);
-	xrDestroySpace(baseSpace);
-	xrEndSession(session);
-	xrDestroySession(session);
+	if (session.session != XR_NULL_HANDLE)
+	{
+		xrEndSession(session.session);
+		session_destroy(&session, opts.guns);
+	}
 	xrDestroyAction(aim);
-	xrDestroyAction(fire);
-	xrDestroyAction(pedal);
-	xrDestroyAction(pause);
+	for (button = 0; button < opts.buttonCount; button += 1)
+	{
+		xrDestroyAction(buttons[button]);
+	}
 	xrDestroyAction(kickback);
 	xrDestroyActionSet(actionSet);
 	xrDestroyInstance(instance);
+	control_close(&control);
+	sampler_destroy(&sampler);
 	return returnCode;
 }
+
+#endif /* LIGHTGUNXR_NO_MAIN */